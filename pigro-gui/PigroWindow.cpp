@@ -1,7 +1,6 @@
 #include "PigroWindow.h"
 
 #include <QFile>
-#include <QTextStream>
 #include <QSettings>
 #include <QFileDialog>
 #include <QMessageBox>
@@ -279,6 +278,6 @@ void PigroWindow::dataReady()
         return;
     }
 
-    QTextStream ts(&file);
-    firmware.saveToTextStream(ts);
+    const std::string hex = firmware.toIntelHex();
+    file.write(hex.data(), hex.size());
 }
@@ -1,6 +1,10 @@
 #include "ARM.h"
 
 #include <nano/exception.h>
+#include <nano/crc.h>
+#include <QFile>
+#include <QCoreApplication>
+#include <algorithm>
 
 static void not_implemented_yet(const std::string &func)
 {
@@ -34,15 +38,74 @@ QString ARM::getIspChipInfo()
 
 FirmwareData ARM::readFirmware()
 {
-    throw nano::exception("ARM::readFirmware() not implemented yet");
+    FirmwareData firmware(arm.page_size);
+
+    debug_enable();
+
+    try
+    {
+        printf("readFirmware() page_size=%u page_count=%u\n", arm.page_size, arm.page_count);
+
+        beginProgress(0, arm.flash_size);
+
+        // адрес ставим один раз, дальше адаптер сам его увеличивает
+        set_memaddr(flash_begin());
+
+        std::vector<uint32_t> words(arm.page_size / 4);
+        std::vector<uint8_t> bytes(arm.page_size);
+        uint32_t used_end = flash_begin();
+        for(uint32_t ipage = 0; ipage < arm.page_count; ipage++)
+        {
+            if ( m_cancel )
+            {
+                throw nano::exception("canceled");
+            }
+
+            read_next32(words.data(), words.size());
+
+            const uint32_t page_addr = flash_begin() + ipage * arm.page_size;
+            for(size_t i = 0; i < words.size(); i++)
+            {
+                bytes[i * 4 + 0] = words[i] & 0xFF;
+                bytes[i * 4 + 1] = (words[i] >> 8) & 0xFF;
+                bytes[i * 4 + 2] = (words[i] >> 16) & 0xFF;
+                bytes[i * 4 + 3] = (words[i] >> 24) & 0xFF;
+            }
+            firmware.write(page_addr, bytes.data(), bytes.size());
+            if ( !is_blank(bytes.data(), bytes.size()) ) used_end = page_addr + arm.page_size;
+
+            reportProgress((ipage + 1) * arm.page_size);
+            QCoreApplication::processEvents();
+        }
+
+        // стертый хвост флеша в прошивку не попадает
+        for(uint32_t addr = used_end; addr < flash_begin() + arm.page_count * arm.page_size; addr += arm.page_size)
+        {
+            firmware.erase(addr);
+        }
+
+        endProgress();
+    }
+    catch (...)
+    {
+        endProgress();
+        debug_disable();
+        throw;
+    }
+
+    debug_disable();
+    return firmware;
 }
 
 void ARM::action_test()
 {
     printf("\ntest STM32/JTAG\n");
 
-    check_idcode_raw();
-    check_bypass<9, 32>(0x12345678);
+    if ( !swd() )
+    {
+        check_idcode_raw();
+        check_bypass<9, 32>(0x12345678);
+    }
 
     debug_enable();
 
@@ -107,24 +170,40 @@ void ARM::isp_check_firmware(const FirmwareData &pages)
     }
     */
 
+    const bool use_crc = crc_verify();
+
     char line[128];
     int line_offset = 0;
     uint32_t pos = 0;
     uint8_t counter = 0;
+    uint32_t mismatched = 0;
+    std::vector<uint32_t> device;
     for(const auto &[page_addr, page] : pages)
     {
+        if ( m_cancel )
+        {
+            debug_disable();
+            endProgress();
+            throw nano::exception("canceled");
+        }
+
         set_memaddr(page_addr);
         const size_t size = page.data.size() / 4;
-        for(size_t i = 0; i < size; i++)
+        device.resize(size);
+        if ( use_crc && read_crc32(size) == nano::crc32(page.data.data(), page.data.size()) )
         {
-            if ( m_cancel )
-            {
-                debug_disable();
-                endProgress();
-                throw nano::exception("canceled");
-            }
+            // CRC совпал, страницу не читаем
+            page_words(page, device);
+        }
+        else
+        {
+            mismatched++;
+            set_memaddr(page_addr);
+            read_next32(device.data(), size);
+        }
 
-            reportProgress(pos+=4);
+        for(size_t i = 0; i < size; i++)
+        {
             const uint16_t offset = i * 4;
             const uint32_t addr = page_addr + offset;
             if ( counter == 0 )
@@ -133,7 +212,7 @@ void ARM::isp_check_firmware(const FirmwareData &pages)
             }
 
             const uint32_t hex_value = page.data[offset] | (page.data[offset+1] << 8) | (page.data[offset+2] << 16) | (page.data[offset+3] << 24);
-            const uint32_t device_value = read_next32();
+            const uint32_t device_value = device[i];
             if ( device_value != hex_value ) differs = true;
 
             line[line_offset++] = (device_value == hex_value ? '.' : '*' );
@@ -143,6 +222,9 @@ void ARM::isp_check_firmware(const FirmwareData &pages)
             }
             counter = (counter + 1) & 0x1F;
         }
+
+        pos += size * 4;
+        reportProgress(pos);
     }
 
     if ( counter != 0 )
@@ -152,6 +234,11 @@ void ARM::isp_check_firmware(const FirmwareData &pages)
 
     reportMessage(QStringLiteral("pos=%1 dataSize=%2").arg(pos).arg(dataSize));
 
+    if ( use_crc )
+    {
+        reportMessage(QStringLiteral("CRC mismatch in %1 pages of %2").arg(mismatched).arg(pages.size()));
+    }
+
     if ( differs )
     {
         reportResult(tr("[ NO ] firmware is different"));
@@ -165,6 +252,94 @@ void ARM::isp_check_firmware(const FirmwareData &pages)
     endProgress();
 }
 
+void ARM::loader_start()
+{
+    QFile file(":/data/stm32_loader.bin");
+    if ( !file.open(QIODevice::ReadOnly) ) throw nano::exception("loader_start(): loader image not found");
+    const QByteArray image = file.readAll();
+    if ( image.isEmpty() || (image.size() % 4) != 0 || uint32_t(image.size()) > LOADER_MAILBOX - LOADER_ADDR )
+    {
+        throw nano::exception("loader_start(): wrong loader image");
+    }
+
+    std::vector<uint32_t> words(image.size() / 4);
+    for(size_t i = 0; i < words.size(); i++)
+    {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(image.constData()) + i * 4;
+        words[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+    }
+
+    core_halt();
+
+    // DCRSR/DCRDR work only while the core is halted
+    QElapsedTimer timer;
+    timer.start();
+    while ( !core_halted() )
+    {
+        if ( timer.elapsed() > 100 ) throw nano::exception("loader_start(): core halt timeout");
+    }
+
+    write_block32(LOADER_ADDR, words.data(), words.size());
+
+    const uint32_t mailbox[7] = { };
+    write_block32(LOADER_MAILBOX, mailbox, 7);
+
+    write_core_reg(REG_R0, LOADER_MAILBOX);
+    write_core_reg(REG_SP, LOADER_STACK);
+    write_core_reg(REG_PC, LOADER_ADDR);
+    write_core_reg(REG_XPSR, 0x01000000); // Thumb state
+
+    loader_buf = 0;
+    core_run();
+}
+
+void ARM::loader_wait(unsigned buf)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while ( read_mem32(loader_desc(buf) + 4) != 0 )
+    {
+        if ( core_halted() )
+        {
+            const uint32_t flash_sr = read_mem32(LOADER_MAILBOX);
+            char sr[32];
+            snprintf(sr, sizeof(sr), " (FLASH_SR: 0x%08X)", flash_sr);
+            if ( flash_sr & (1 << 4) ) throw nano::exception(std::string("WRPRTERR: Write protection error") + sr);
+            if ( flash_sr & (1 << 2) ) throw nano::exception(std::string("PGERR: Programming error (cell already programmed)") + sr);
+            throw nano::exception(std::string("flash loader stopped unexpectedly") + sr);
+        }
+        if ( timer.elapsed() > 1000 ) throw nano::exception("flash loader timeout");
+    }
+}
+
+void ARM::loader_program(uint32_t addr, const uint32_t *data, size_t count)
+{
+    constexpr size_t chunk = LOADER_BUFFER_SIZE / 4;
+    for(size_t i = 0; i < count; i += chunk)
+    {
+        const size_t n = std::min(chunk, count - i);
+        const unsigned buf = loader_buf;
+        const uint32_t buffer = LOADER_BUFFER + buf * LOADER_BUFFER_SIZE;
+
+        loader_wait(buf);
+        write_block32(buffer, data + i, n);
+
+        // size пишем последним, после него буфер принадлежит загрузчику
+        write_mem32(loader_desc(buf), addr + i * 4);
+        write_mem32(loader_desc(buf) + 8, buffer);
+        write_mem32(loader_desc(buf) + 4, n * 4);
+
+        loader_buf = buf ^ 1;
+    }
+}
+
+void ARM::loader_finish()
+{
+    loader_wait(0);
+    loader_wait(1);
+    core_halt();
+}
+
 void ARM::isp_write_firmware(const FirmwareData &pages)
 {
     const auto dataSize = pages.getDataSize();
@@ -195,56 +370,137 @@ void ARM::isp_write_firmware(const FirmwareData &pages)
     }
     */
 
-    fpec_mass_erase();
+    const bool diff_mode = incremental();
+    const bool use_crc = diff_mode && crc_verify();
+    const bool use_loader = !diff_mode && flash_loader();
+    if ( diff_mode )
+    {
+        reportMessage("incremental mode: only changed pages will be written");
+    }
+    else
+    {
+        fpec_mass_erase();
 
-    write_fpec(0x10, 1); // FLASH_CR_PG
+        if ( use_loader )
+        {
+            loader_start();
+        }
+        else
+        {
+            write_fpec(0x10, 1); // FLASH_CR_PG
 
-    printf("flash_cr: 0x%08X\n", read_fpec(0x10));
+            printf("flash_cr: 0x%08X\n", read_fpec(0x10));
+        }
+    }
 
     char line[128];
     int line_offset = 0;
     uint32_t pos = 0;
     uint8_t counter = 0;
+    uint32_t skipped = 0;
+    uint32_t unchanged = 0;
+    std::vector<uint32_t> words;
+    std::vector<uint32_t> device;
     for(const auto &[page_addr, page] : pages)
     {
-        set_memaddr(page_addr);
+        if ( m_cancel )
+        {
+            if ( use_loader ) core_halt();
+            write_fpec(0x10, 0); // FLASH_CR_PG
+            lock_fpec();
+
+            debug_disable();
+
+            endProgress();
+            throw nano::exception("canceled");
+        }
+
         const size_t size = page.data.size() / 4;
-        for(size_t i = 0; i < size; i++)
+        page_words(page, words);
+
+        bool blank = page.blank();
+        if ( diff_mode )
         {
-            if ( m_cancel )
+            set_memaddr(page_addr);
+            device.resize(size);
+            if ( use_crc && read_crc32(size) == nano::crc32(page.data.data(), page.data.size()) )
             {
-                write_fpec(0x10, 0); // FLASH_CR_PG
-                lock_fpec();
-
-                debug_disable();
+                device = words;
+            }
+            else
+            {
+                set_memaddr(page_addr);
+                read_next32(device.data(), size);
+            }
 
-                endProgress();
-                throw nano::exception("canceled");
+            if ( device == words )
+            {
+                unchanged++;
+                blank = true;
+            }
+            else
+            {
+                const bool device_blank = std::all_of(device.begin(), device.end(), [] (uint32_t w) { return w == ERASED_WORD; });
+                if ( !device_blank ) fpec_page_erase(page_addr);
+
+                if ( !blank )
+                {
+                    write_fpec(0x10, 1); // FLASH_CR_PG
+                    program_words(page_addr, words.data(), size);
+                    write_fpec(0x10, 0);
+                }
             }
+        }
+        else if ( blank )
+        {
+            // после mass erase страница и так заполнена 0xFF
+            skipped++;
+        }
+        else if ( use_loader )
+        {
+            loader_program(page_addr, words.data(), size);
+        }
+        else
+        {
+            program_words(page_addr, words.data(), size);
+        }
 
-            reportProgress(pos+=4);
-            const uint32_t offset = i * 4;
-            const uint32_t addr = page_addr + offset;
+        for(size_t i = 0; i < size; i++)
+        {
+            const uint32_t addr = page_addr + i * 4;
             if ( counter == 0 )
             {
                 line_offset = sprintf(line, "MEM[0x%08X]", addr);
             }
-            const uint32_t word = page.data[offset] | (page.data[offset+1] << 8) | (page.data[offset+2] << 16) | (page.data[offset+3] << 24);
-            cmd_program_next(word);
-            line[line_offset++] = '.';
+            line[line_offset++] = (blank || words[i] == ERASED_WORD) ? ' ' : '.';
             if ( counter == 0x1F )
             {
                 reportMessage(QString::fromUtf8(line, line_offset));
             }
             counter = (counter + 1) & 0x1F;
         }
+
+        pos += size * 4;
+        reportProgress(pos);
     }
 
+    if ( use_loader ) loader_finish();
+
     if ( counter != 0 )
     {
         reportMessage(QString::fromUtf8(line, line_offset));
     }
 
+    if ( skipped )
+    {
+        reportMessage(QStringLiteral("skipped %1 blank pages").arg(skipped));
+    }
+
+    if ( diff_mode )
+    {
+        reportMessage(QStringLiteral("skipped %1 unchanged pages of %2").arg(unchanged).arg(pages.size()));
+    }
+
     write_fpec(0x10, 0); // FLASH_CR_PG
     lock_fpec();
 
@@ -2,6 +2,9 @@
 #define PIGRO_ARM_DRIVER_H
 
 #include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <QElapsedTimer>
 
 #include <nano/string.h>
 #include <nano/exception.h>
@@ -32,6 +35,16 @@ public:
         return (idcode & 0x0FFFFFFF) == (CORTEX_M3_IDCODE & 0x0FFFFFFF);
     }
 
+    /**
+     * SW-DP IDCODE (DPIDR) of Cortex-M3
+     */
+    static constexpr uint32_t CORTEX_M3_DPIDR = 0x1BA01477;
+
+    static constexpr bool is_cortex_m3_dpidr(uint32_t idcode)
+    {
+        return (idcode & 0x0FFFFFFF) == (CORTEX_M3_DPIDR & 0x0FFFFFFF);
+    }
+
 
     static constexpr uint32_t CSYSPWRUPACK = 1 << 31; // RO  System power-up acknowledge.
     static constexpr uint32_t CSYSPWRUPREQ = 1 << 30; // R/W System power-up request.
@@ -50,6 +63,26 @@ public:
 
     ArmDeviceInfo arm;
 
+    /**
+     * Incremental write: compare every page with the device, then erase
+     * and program only the pages that differ (pigro.ini: incremental = yes)
+     */
+    bool incremental() const
+    {
+        return nano::parse_bool(get_option("incremental", "no"));
+    }
+
+    /**
+     * Debug transport (pigro.ini: transport = jtag | swd)
+     */
+    bool swd() const
+    {
+        const std::string transport = get_option("transport", "jtag");
+        if ( transport == "swd" ) return true;
+        if ( transport != "jtag" ) throw nano::exception("unknown transport: " + transport);
+        return false;
+    }
+
     ARM(PigroLink *link, Pigro *owner);
     ARM(const ARM &) = delete;
     ARM(ARM &&) = delete;
@@ -71,7 +104,7 @@ public:
      *   ... other is a fault (reserved codes)
      *
      * 0x00 - success
-     * 0x1X - I/O failure (unexpected reply from shift-ir)
+     * 0x1X - I/O failure (unexpected reply from shift-ir, no reply or parity error in SWD)
      * 0x2X - command failure (CTRL/STAT reports some sticky flags)
      * 0x4X - select failure (write to SELECT register)
      */
@@ -203,6 +236,10 @@ public:
         return read_bits<bitcount>(&pkt.data[2]);
     }
 
+    /**
+     * DP/AP register access, works for both transports:
+     * in SWD mode the adapter maps IR_DPACC/IR_APACC to APnDP
+     */
     uint32_t cmd_xpacc(uint8_t ir, uint8_t reg, uint32_t value, bool write)
     {
         //printf("cmd_xpacc(0x%02X, 0x%02X, 0x%08X, %s):\n", ir, reg, value, action(write));
@@ -278,6 +315,18 @@ public:
         if ( result != ap ) throw nano::exception("set_memap() failed");
     }
 
+    /**
+     * Select adapter transport, SWD switch is done by the adapter
+     * (JTAG-to-SWD sequence and DPIDR read)
+     */
+    void set_transport(bool swd)
+    {
+        const uint8_t value = swd ? 1 : 0;
+        const uint8_t result = cmd_config<8>(3, value, "set_transport()");
+        if ( result == 0xFF ) throw nano::exception("set_transport(): SW-DP does not respond");
+        if ( result != value ) throw nano::exception("set_transport() failed");
+    }
+
     void set_memaddr(uint32_t addr)
     {
         //printf("set_memaddr(0x%08X)\n", addr);
@@ -286,24 +335,133 @@ public:
     }
 
     template <uint8_t bitcount>
-    uint64_t read_next()
+    void send_read_next()
     {
         constexpr uint8_t bytecount = (bitcount + 7) / 8;
         packet_t pkt;
         pkt.cmd = 12;
         pkt.len = bytecount;
         send_packet(pkt);
+    }
+
+    template <uint8_t bitcount>
+    uint64_t recv_read_next()
+    {
+        constexpr uint8_t bytecount = (bitcount + 7) / 8;
+        packet_t pkt;
         recv_packet(pkt);
         check_error("read_next()", pkt);
         if ( pkt.len != bytecount ) throw nano::exception("read_next() wrong length: " + std::to_string(pkt.len));
         return read_bits<bitcount>(&pkt.data[0]);
     }
 
+    template <uint8_t bitcount>
+    uint64_t read_next()
+    {
+        send_read_next<bitcount>();
+        return recv_read_next<bitcount>();
+    }
+
     inline uint32_t read_next32()
     {
         return read_next<32>();
     }
 
+    /**
+     * Max word count for one arm_read_block command
+     */
+    static constexpr size_t READ_BLOCK_MAX = 0xFFFF;
+
+    /**
+     * Read block of 32-bit words from current memory address (arm_read_block)
+     *
+     * The adapter reads words with MEM-AP auto-increment and streams
+     * them back in bulk frames, a one-byte frame is an error code
+     */
+    void read_block32(uint32_t *data, size_t count)
+    {
+        packet_t pkt;
+        pkt.cmd = 22;
+        pkt.len = 2;
+        write_bits<16>(&pkt.data[0], count);
+
+        // the adapter streams bulk_size / 4 words per frame
+        const size_t frame_words = bulk_size() / 4;
+        unsigned frames = (count + frame_words - 1) / frame_words;
+        send_packet(pkt, frames);
+
+        size_t pos = 0;
+        while ( pos < count )
+        {
+            bulk_t reply;
+            recv_packet(reply);
+            frames--;
+            if ( reply.cmd != 22 ) throw nano::exception("read_block32() wrong reply: cmd=" + std::to_string(reply.cmd));
+            if ( reply.data.size() == 1 )
+            {
+                // an error frame ends the stream early
+                cancel_replies(frames);
+                check_error("read_block32()", reply.data[0]);
+            }
+
+            const size_t n = reply.data.size() / 4;
+            if ( n == 0 || (reply.data.size() % 4) != 0 || pos + n > count )
+            {
+                throw nano::exception("read_block32() wrong length: " + std::to_string(reply.data.size()));
+            }
+            for(size_t i = 0; i < n; i++)
+            {
+                data[pos + i] = read_bits<32>(&reply.data[i * 4]);
+            }
+            pos += n;
+        }
+    }
+
+    /**
+     * CRC-32 of count words from current memory address (arm_crc)
+     *
+     * The adapter reads the words itself, only the CRC goes over the link
+     */
+    uint32_t read_crc32(size_t count)
+    {
+        packet_t pkt;
+        pkt.cmd = 25;
+        pkt.len = 2;
+        write_bits<16>(&pkt.data[0], count);
+        send_packet(pkt);
+        recv_packet(pkt);
+        if ( pkt.cmd != 25 ) throw nano::exception("read_crc32() wrong reply: cmd=" + std::to_string(pkt.cmd));
+        check_error("read_crc32()", pkt);
+        if ( pkt.len != 4 ) throw nano::exception("read_crc32() wrong length: " + std::to_string(pkt.len));
+        return read_bits<32>(&pkt.data[0]);
+    }
+
+    /**
+     * Read block of 32-bit words from current memory address
+     *
+     * In windowed mode all requests are sent first, then replies are read
+     */
+    void read_next32(uint32_t *data, size_t count)
+    {
+        if ( bulk_size() >= 4 )
+        {
+            for(size_t i = 0; i < count; i += READ_BLOCK_MAX)
+            {
+                read_block32(data + i, std::min(READ_BLOCK_MAX, count - i));
+            }
+            return;
+        }
+
+        if ( !windowed() )
+        {
+            for(size_t i = 0; i < count; i++) data[i] = read_next32();
+            return;
+        }
+
+        for(size_t i = 0; i < count; i++) send_read_next<32>();
+        for(size_t i = 0; i < count; i++) data[i] = recv_read_next<32>();
+    }
+
     inline uint16_t read_next16()
     {
         return read_next<16>();
@@ -335,7 +493,7 @@ public:
         return write_next<16>(value);
     }
 
-    void cmd_program_next(uint32_t value)
+    void send_program_next(uint32_t value)
     {
         packet_t pkt;
         pkt.cmd = 14;
@@ -343,6 +501,11 @@ public:
         write_bits<32>(&pkt.data[0], value);
         //dump_packet("cmd_program_next() send", pkt);
         send_packet(pkt);
+    }
+
+    void recv_program_next(uint32_t value)
+    {
+        packet_t pkt;
         recv_packet(pkt);
         //dump_packet("cmd_program_next() recv", pkt);
         if ( pkt.cmd != 14 ) throw nano::exception("cmd_program_next() wrong cmd=" + std::to_string(pkt.cmd));
@@ -358,6 +521,69 @@ public:
         if ( output != value ) throw nano::exception("cmd_program_next() failed");
     }
 
+    void cmd_program_next(uint32_t value)
+    {
+        send_program_next(value);
+        recv_program_next(value);
+    }
+
+    /**
+     * Program block of 32-bit words starting from current memory address
+     *
+     * In windowed mode all requests are sent first, then replies are checked
+     */
+    void cmd_program_next(const uint32_t *data, size_t count)
+    {
+        if ( !windowed() )
+        {
+            for(size_t i = 0; i < count; i++) cmd_program_next(data[i]);
+            return;
+        }
+
+        for(size_t i = 0; i < count; i++) send_program_next(data[i]);
+        for(size_t i = 0; i < count; i++) recv_program_next(data[i]);
+    }
+
+    static constexpr uint32_t ERASED_WORD = 0xFFFFFFFF;
+
+    /**
+     * Page data as 32-bit little-endian words
+     */
+    static void page_words(const PageData &page, std::vector<uint32_t> &words)
+    {
+        words.resize(page.data.size() / 4);
+        for(size_t i = 0; i < words.size(); i++)
+        {
+            const uint8_t *p = page.data.data() + i * 4;
+            words[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+        }
+    }
+
+    /**
+     * Program block of 32-bit words starting from addr, skipping erased words
+     *
+     * Skipping costs one set_memaddr(), so only runs of at least
+     * two erased words are skipped
+     */
+    void program_words(uint32_t addr, const uint32_t *data, size_t count)
+    {
+        size_t i = 0;
+        while ( i < count )
+        {
+            size_t blank = i;
+            while ( blank < count && data[blank] == ERASED_WORD ) blank++;
+            if ( blank == count ) return;
+            if ( blank - i < 2 ) blank = i;
+
+            size_t end = blank + 1;
+            while ( end < count && !(data[end] == ERASED_WORD && (end + 1 == count || data[end + 1] == ERASED_WORD)) ) end++;
+
+            set_memaddr(addr + blank * 4);
+            cmd_program_next(data + blank, end - blank);
+            i = end;
+        }
+    }
+
     template <uint8_t bitcount>
     uint64_t read_mem(uint32_t addr)
     {
@@ -445,6 +671,14 @@ public:
         return idcode;
     }
 
+    uint32_t check_dpidr()
+    {
+        const uint32_t idcode = read_dp(0x0);
+        const char *status = is_cortex_m3_dpidr(idcode) ? "[ ok ]" : "[fail]";
+        printf("SWD idcode: 0x%08X %s\n", idcode, status);
+        return idcode;
+    }
+
     uint32_t check_idcode_raw()
     {
         printf("\ncheck_idcode_raw()\n");
@@ -495,7 +729,12 @@ public:
         cmd_jtag_reset(0);
         cmd_jtag_reset(2);
 
-        if ( !is_cortex_m3_idcode( check_idcode() ) ) throw nano::exception("only Cortex M3 supported yet");
+        if ( swd() )
+        {
+            set_transport(true);
+            if ( !is_cortex_m3_dpidr( check_dpidr() ) ) throw nano::exception("only Cortex M3 supported yet");
+        }
+        else if ( !is_cortex_m3_idcode( check_idcode() ) ) throw nano::exception("only Cortex M3 supported yet");
 
         uint32_t status = CSYSPWRUPREQ | CDBGPWRUPREQ;
         write_dp(0x4, status);
@@ -686,15 +925,171 @@ public:
         printf("FPEC status unknown\n");
     }
 
+    /**
+     * Wait until FLASH_SR.BSY is cleared
+     */
+    void wait_fpec_ready(int timeout_ms)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        while ( read_fpec(0x0C) & 1 )
+        {
+            if ( timer.elapsed() > timeout_ms ) throw nano::exception("FPEC busy timeout");
+        }
+    }
+
     void fpec_mass_erase()
     {
         printf("\nfpec_mass_erase()\n");
         reset_flash_sr();
         write_fpec(0x10, (1 << 2)); // FLASH_CR_MER
         write_fpec(0x10, (1 << 2) | (1 << 6)); // FLASH_CR_STRT
+        wait_fpec_ready(500);
+        check_flash_sr();
+    }
+
+    /**
+     * Erase one flash page (FLASH_CR_PER + FLASH_AR)
+     */
+    void fpec_page_erase(uint32_t page_addr)
+    {
+        reset_flash_sr();
+        write_fpec(0x10, (1 << 1)); // FLASH_CR_PER
+        write_fpec(0x14, page_addr); // FLASH_AR
+        write_fpec(0x10, (1 << 1) | (1 << 6)); // FLASH_CR_STRT
+        wait_fpec_ready(100);
         check_flash_sr();
+        write_fpec(0x10, 0);
+    }
+
+    static constexpr uint32_t DHCSR = 0xE000EDF0;
+    static constexpr uint32_t DCRSR = 0xE000EDF4;
+    static constexpr uint32_t DCRDR = 0xE000EDF8;
+
+    static constexpr uint32_t DHCSR_KEY = 0xA05F0000;
+    static constexpr uint32_t C_DEBUGEN = 1 << 0;
+    static constexpr uint32_t C_HALT = 1 << 1;
+    static constexpr uint32_t S_REGRDY = 1 << 16;
+    static constexpr uint32_t S_HALT = 1 << 17;
+
+    static constexpr uint8_t REG_R0 = 0;
+    static constexpr uint8_t REG_SP = 13;
+    static constexpr uint8_t REG_PC = 15;
+    static constexpr uint8_t REG_XPSR = 16;
+
+    /**
+     * Write core register through DCRSR/DCRDR, the core must be halted
+     */
+    void write_core_reg(uint8_t reg, uint32_t value)
+    {
+        write_mem32(DCRDR, value);
+        write_mem32(DCRSR, (1 << 16) | reg); // REGWnR
+        QElapsedTimer timer;
+        timer.start();
+        while ( (read_mem32(DHCSR) & S_REGRDY) == 0 )
+        {
+            if ( timer.elapsed() > 100 ) throw nano::exception("write_core_reg() timeout");
+        }
+    }
+
+    void core_halt()
+    {
+        write_mem32(DHCSR, DHCSR_KEY | C_HALT | C_DEBUGEN);
+    }
+
+    void core_run()
+    {
+        write_mem32(DHCSR, DHCSR_KEY | C_DEBUGEN);
+    }
+
+    bool core_halted()
+    {
+        return read_mem32(DHCSR) & S_HALT;
+    }
+
+    /**
+     * Write block of 32-bit words to memory starting from addr
+     */
+    void write_block32(uint32_t addr, const uint32_t *data, size_t count)
+    {
+        set_memaddr(addr);
+
+        if ( bulk_size() < 4 )
+        {
+            for(size_t i = 0; i < count; i++) write_next32(data[i]);
+            return;
+        }
+
+        // arm_write_block: the adapter writes words with MEM-AP auto-increment
+        const size_t chunk = bulk_size() / 4;
+        std::vector<uint8_t> frame;
+        size_t sent = 0;
+        for(size_t i = 0; i < count; i += chunk)
+        {
+            const size_t n = std::min(chunk, count - i);
+            frame.resize(n * 4);
+            for(size_t j = 0; j < n; j++) write_bits<32>(&frame[j * 4], data[i + j]);
+            send_packet(23, frame.data(), frame.size());
+            sent++;
+
+            if ( !windowed() ) recv_write_block();
+        }
+
+        if ( windowed() )
+        {
+            for(size_t i = 0; i < sent; i++) recv_write_block();
+        }
+    }
+
+    void recv_write_block()
+    {
+        packet_t pkt;
+        recv_packet(pkt);
+        if ( pkt.cmd != 23 ) throw nano::exception("write_block32() wrong reply: cmd=" + std::to_string(pkt.cmd));
+        if ( pkt.len != 1 ) throw nano::exception("write_block32() wrong length: " + std::to_string(pkt.len));
+        check_error("write_block32()", pkt.data[0]);
     }
 
+    /**
+     * SRAM flash loader (data/stm32_loader.s)
+     *
+     * The loader runs on the target core and programs flash from two SRAM
+     * buffers. The host fills a free buffer while the loader programs the
+     * other one, so flash programming overlaps with the link transfer.
+     *
+     * Mailbox words: status, then dst/size/src for each buffer. The host
+     * writes size last; the loader clears it when the buffer is done.
+     * On a flash error the loader stores FLASH_SR to status and halts.
+     */
+    static constexpr uint32_t LOADER_ADDR = 0x20000000;
+    static constexpr uint32_t LOADER_MAILBOX = LOADER_ADDR + 0x80;
+    static constexpr uint32_t LOADER_BUFFER = LOADER_ADDR + 0x100;
+    static constexpr uint32_t LOADER_BUFFER_SIZE = 1024;
+    static constexpr uint32_t LOADER_STACK = LOADER_BUFFER + 2 * LOADER_BUFFER_SIZE + 0x100;
+
+    static constexpr uint32_t loader_desc(unsigned buf)
+    {
+        return LOADER_MAILBOX + 4 + buf * 12;
+    }
+
+    /**
+     * Next buffer to fill
+     */
+    unsigned loader_buf = 0;
+
+    /**
+     * Use the SRAM loader to program flash (pigro.ini: flash_loader = no to disable)
+     */
+    bool flash_loader() const
+    {
+        return nano::parse_bool(get_option("flash_loader", "yes"));
+    }
+
+    void loader_start();
+    void loader_wait(unsigned buf);
+    void loader_program(uint32_t addr, const uint32_t *data, size_t count);
+    void loader_finish();
+
     void dump_mem32(uint32_t addr)
     {
         const uint32_t value = read_mem32(addr);
@@ -759,6 +1154,15 @@ public:
         return flash_begin() + page_size() * page_count();
     }
 
+    /**
+     * Raw binaries are loaded at the start of flash unless base_address is set
+     */
+    uint32_t base_address() const override
+    {
+        if ( get_option("base_address").empty() ) return flash_begin();
+        return PigroDriver::base_address();
+    }
+
     bool page_in_range(uint32_t page, uint32_t begin, uint32_t end)
     {
         return (page >= begin) && (page < end);
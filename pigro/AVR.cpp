@@ -1,8 +1,10 @@
 #include "AVR.h"
 #include "trace.h"
+#include <nano/crc.h>
 
 #include <QCoreApplication>
 #include <vector>
+#include <algorithm>
 
 AVR::AVR(PigroLink *link, Pigro *owner): PigroDriver(link, owner)
 {
@@ -44,9 +46,14 @@ QString AVR::getIspChipInfo()
     return QString::fromLatin1(buf);
 }
 
+/**
+ * Сколько байт читать одной командой при чтении всей прошивки
+ */
+constexpr unsigned READ_CHUNK_SIZE = 4096;
+
 FirmwareData AVR::readFirmware()
 {
-    FirmwareData firmware;
+    FirmwareData firmware(page_size());
 
     isp_program_enable();
 
@@ -57,7 +64,7 @@ FirmwareData AVR::readFirmware()
             throw nano::exception("saveFirmwareToFile() reject: wrong chip signature");
         }
 
-        if ( !avr.valid() || !avr.paged )
+        if ( !avr.valid() )
         {
             throw nano::exception("saveFirmwareToFile() reject: unsupported chip");
         }
@@ -68,26 +75,25 @@ FirmwareData AVR::readFirmware()
 
         const unsigned page_size = avr.page_byte_size();
 
-        PageData page;
-        page.resize(page_size);
+        // читаем сразу несколько страниц, адаптер отдает их потоком
+        const unsigned chunk_pages = std::max(1u, READ_CHUNK_SIZE / page_size);
+        std::vector<uint8_t> chunk(chunk_pages * page_size);
 
-        for(unsigned ipage = 0; ipage < avr.page_count; ipage++)
+        for(unsigned ipage = 0; ipage < avr.page_count; ipage += chunk_pages)
         {
-            page.addr = ipage * page_size;
-            for(unsigned ibyte = 0; ibyte < page_size; ibyte++)
+            if ( m_cancel )
             {
-                if ( m_cancel )
-                {
-                    throw nano::exception("canceled");
-                }
-
-                uint32_t addr = page.addr + ibyte;
-                page.data[ibyte] = isp_read_memory(addr);
-                reportProgress(addr);
-                QCoreApplication::processEvents();
+                throw nano::exception("canceled");
             }
 
-            firmware.emplace(page.addr, page);
+            const unsigned count = std::min(chunk_pages, avr.page_count - ipage);
+            const uint32_t chunk_addr = ipage * page_size;
+            isp_read_memory(chunk_addr, chunk.data(), count * page_size);
+
+            firmware.write(chunk_addr, chunk.data(), count * page_size);
+
+            reportProgress(chunk_addr + count * page_size - 1);
+            QCoreApplication::processEvents();
         }
 
         endProgress();
@@ -103,6 +109,69 @@ FirmwareData AVR::readFirmware()
     return firmware;
 }
 
+uint8_t AVR::isp_clock_limit()
+{
+    const std::string value = get_option("isp_clock", "auto");
+    if ( value == "auto" ) return ISP_CLOCK_MAX;
+
+    // частота в Гц, допускаются суффиксы k и M
+    uint32_t scale = 1;
+    std::string digits = value;
+    if ( !digits.empty() && (digits.back() == 'k' || digits.back() == 'K') ) scale = 1000;
+    if ( !digits.empty() && digits.back() == 'M' ) scale = 1000000;
+    if ( scale != 1 ) digits.pop_back();
+
+    const uint32_t hz = nano::parse_int(digits) * scale;
+    if ( hz == 0 ) throw nano::exception("wrong isp_clock (pigro.ini): " + value);
+
+    uint8_t index = 0;
+    while ( index < ISP_CLOCK_MAX && isp_clock_hz(index + 1) <= hz ) index++;
+    if ( isp_clock_hz(index) > hz ) warn("isp_clock is lower than the slowest adapter clock");
+    return index;
+}
+
+void AVR::isp_tune_clock()
+{
+    // сигнатура на самой медленной частоте служит эталоном
+    const DeviceCode reference = isp_read_chip_info();
+    const bool readable = reference != DeviceCode{0x00, 0x00, 0x00} && reference != DeviceCode{0xFF, 0xFF, 0xFF};
+    const uint8_t limit = readable ? isp_clock_limit() : 0;
+
+    uint8_t best = 0;
+    bool failed = false;
+    for(uint8_t index = 1; index <= limit; index++)
+    {
+        cmd_isp_clock(index);
+
+        uint32_t r;
+        DeviceCode code;
+        PigroBatch b = batch();
+        b.isp_io(0xAC530000, r);
+        for(uint8_t i = 0; i < code.size(); i++)
+        {
+            b.isp_io(0x30000000 | (i << 8), [&code, i] (uint32_t r) { code[i] = r & 0xFF; });
+        }
+        b.exec();
+
+        if ( (r & 0xFF00) != 0x5300 || code != reference )
+        {
+            failed = true;
+            break;
+        }
+        best = index;
+    }
+
+    m_isp_clock = best;
+    if ( failed )
+    {
+        // после сбоя чип мог потерять синхронизацию, входим заново
+        cmd_isp_clock(best);
+        isp_program_enable();
+    }
+
+    reportMessage(QStringLiteral("ISP clock: %1 kHz").arg(isp_clock_hz(best) / 1000.0, 0, 'f', 1));
+}
+
 bool AVR::check_firmware(const FirmwareData &pages, bool verbose)
 {
     bool status = true;
@@ -128,11 +197,142 @@ bool AVR::check_firmware(const FirmwareData &pages, bool verbose)
     return status;
 }
 
+FirmwareData AVR::eeprom_image() const
+{
+    const QString path = firmwareInfo().eepromFilePath;
+    if ( path.isEmpty() ) return FirmwareData();
+
+    if ( avr.eeprom_size() == 0 )
+    {
+        throw nano::exception("eeprom (pigro.ini): chip has no EEPROM");
+    }
+
+    // страница в один байт: в образе только те байты, что заданы в
+    // файле, остальные ячейки EEPROM (например при EESAVE) не трогаем
+    FirmwareData bytes = FirmwareData::LoadFromFile(path.toStdString(), 1, 0xFF);
+    for(const auto &[addr, byte] : bytes)
+    {
+        if ( addr >= avr.eeprom_size() )
+        {
+            throw nano::exception("eeprom image out of range at " + std::to_string(addr));
+        }
+    }
+    return bytes;
+}
+
+std::vector<AVR::eeprom_block_t> AVR::eeprom_blocks(const FirmwareData &bytes) const
+{
+    // побайтовую EEPROM группируем в блоки только для отчета и проверки
+    const uint32_t block_size = avr.eeprom_paged() ? avr.eeprom_page_size : 32;
+
+    std::vector<eeprom_block_t> blocks;
+    for(const auto &[addr, byte] : bytes)
+    {
+        const bool next = !blocks.empty() && blocks.back().addr + blocks.back().data.size() == addr;
+        if ( !next || addr % block_size == 0 )
+        {
+            blocks.push_back({ addr, { } });
+        }
+        blocks.back().data.push_back(byte.data[0]);
+    }
+    return blocks;
+}
+
+void AVR::write_eeprom(const FirmwareData &bytes, uint32_t progress)
+{
+    // стертые байты не пропускаем: при EESAVE стирание чипа
+    // не затрагивает EEPROM
+    const std::vector<eeprom_block_t> blocks = eeprom_blocks(bytes);
+    const uint32_t page_size = avr.eeprom_page_size;
+    uint32_t pos = 0;
+    std::vector<uint8_t> page;
+    for(size_t index = 0; index < blocks.size(); )
+    {
+        if ( m_cancel )
+        {
+            throw nano::exception("canceled");
+        }
+
+        const eeprom_block_t &block = blocks[index++];
+        pos += block.data.size();
+
+        if ( !avr.eeprom_paged() || block.data.size() == page_size )
+        {
+            isp_program_eeprom_page(block.addr, block.data.data(), block.data.size());
+        }
+        else
+        {
+            // страница задана не целиком: недостающие байты читаем
+            // из чипа, чтобы запись страницы их не изменила
+            const uint32_t page_addr = block.addr - block.addr % page_size;
+            page.resize(page_size);
+            isp_read_eeprom(page_addr, page.data(), page.size());
+            std::copy(block.data.begin(), block.data.end(), page.begin() + (block.addr - page_addr));
+            for(; index < blocks.size() && blocks[index].addr < page_addr + page_size; index++)
+            {
+                const eeprom_block_t &next = blocks[index];
+                std::copy(next.data.begin(), next.data.end(), page.begin() + (next.addr - page_addr));
+                pos += next.data.size();
+            }
+            isp_program_eeprom_page(page_addr, page.data(), page.size());
+        }
+
+        reportProgress(progress + pos);
+        QCoreApplication::processEvents();
+    }
+
+    reportMessage(QStringLiteral("EEPROM: %1 bytes written").arg(pos));
+}
+
+bool AVR::check_eeprom(const FirmwareData &bytes)
+{
+    const std::vector<eeprom_block_t> blocks = eeprom_blocks(bytes);
+
+    std::vector<bool> same(blocks.size(), false);
+    if ( crc_verify() )
+    {
+        for(size_t index = 0; index < blocks.size(); index++)
+        {
+            const eeprom_block_t &block = blocks[index];
+            const uint32_t expected = nano::crc32(block.data.data(), block.data.size());
+            isp_crc(block.addr, block.data.size(), [&same, index, expected] (uint32_t crc) {
+                same[index] = (crc == expected);
+            }, ISP_MEMORY_EEPROM);
+        }
+        wait_replies();
+    }
+
+    uint32_t differs = 0;
+    std::vector<uint8_t> device;
+    for(size_t index = 0; index < blocks.size(); index++)
+    {
+        if ( same[index] ) continue;
+
+        const eeprom_block_t &block = blocks[index];
+        device.resize(block.data.size());
+        isp_read_eeprom(block.addr, device.data(), device.size());
+        for(size_t i = 0; i < device.size(); i++)
+        {
+            if ( device[i] == block.data[i] ) continue;
+            if ( differs++ < 16 )
+            {
+                char line[64];
+                const auto line_size = snprintf(line, sizeof(line), "EEPROM[0x%04X] 0x%02X != 0x%02X", unsigned(block.addr + i), device[i], block.data[i]);
+                reportMessage(QString::fromUtf8(line, line_size));
+            }
+        }
+    }
+
+    reportMessage(QStringLiteral("EEPROM: %1 bytes differ").arg(differs));
+    return differs == 0;
+}
+
 void AVR::check_fuse()
 {
-    uint8_t fuse_lo = isp_read_fuse_low();  // cmd_isp_io(0x50000000) & 0xFF;
-    uint8_t fuse_hi = isp_read_fuse_high(); // cmd_isp_io(0x58080000) & 0xFF;
-    uint8_t fuse_ex = isp_read_fuse_ext();  // cmd_isp_io(0x50080000) & 0xFF;
+    const fuses_t fuses = isp_read_fuses();
+    uint8_t fuse_lo = fuses.low;
+    uint8_t fuse_hi = fuses.high;
+    uint8_t fuse_ex = fuses.ext;
 
     const char *status;
     char line[128];
@@ -181,6 +381,22 @@ void AVR::parse_device_info(const nano::options &options)
     avr.page_word_size = atoi(options.value("page_size").c_str());
     avr.page_count = atoi(options.value("page_count").c_str());
     avr.paged = nano::parse_bool(options.value("paged", "yes"));
+    avr.flash_write_delay = nano::parse_int(options.value("flash_write_delay", "20000"));
+    avr.eeprom_write_delay = nano::parse_int(options.value("eeprom_write_delay", "20000"));
+    avr.chip_erase_delay = nano::parse_int(options.value("chip_erase_delay", "20000"));
+    avr.rdy_bsy = nano::parse_bool(options.value("rdy_bsy", "no"));
+    avr.eeprom_page_size = nano::parse_int(options.value("eeprom_page_size", "0"));
+    avr.eeprom_page_count = nano::parse_int(options.value("eeprom_page_count", "0"));
+
+    if ( !avr.paged )
+    {
+        // у побайтовой флеш страниц нет, группируем байты в условные
+        // страницы только для FirmwareData и отчетов
+        const uint32_t size = nano::parse_int(options.value("flash_size", "0"));
+        avr.page_word_size = BYTE_WRITE_GROUP / 2;
+        avr.page_count = size / BYTE_WRITE_GROUP;
+        avr.flash_readback = nano::parse_hex<uint32_t>(options.value("flash_readback", "0xFF")) & 0xFF;
+    }
 
     if ( verbose() )
     {
@@ -192,11 +408,7 @@ void AVR::parse_device_info(const nano::options &options)
         std::cout << "flash_size: " << ((avr.flash_size()+1023) / 1024) << "k\n";
     }
 
-    if ( !avr.paged )
-    {
-        warn("unsupported chip, only Write Page supported");
-    }
-    else if ( !avr.valid() )
+    if ( !avr.valid() )
     {
         warn("invalid or unsupported chip data, check database");
     }
@@ -225,6 +437,8 @@ void AVR::isp_check_firmware(const FirmwareData &pages)
 {
     reportMessage("AVR::isp_check_firmware()");
 
+    const FirmwareData eeprom = eeprom_image();
+
     beginProgress(0, pages.getDataSize());
 
     isp_program_enable();
@@ -232,31 +446,61 @@ void AVR::isp_check_firmware(const FirmwareData &pages)
     check_chip_info();
     check_fuse();
 
+    // сначала сравниваем CRC страниц, побайтно читаем только несовпавшие
+    const bool use_crc = crc_verify();
+    std::vector<bool> same(pages.size(), false);
+    if ( use_crc )
+    {
+        size_t index = 0;
+        for(const auto &[page_addr, page] : pages)
+        {
+            const uint32_t expected = nano::crc32(page.data.data(), page.data.size());
+            isp_crc(page_addr, page.data.size(), [&same, index, expected] (uint32_t crc) {
+                same[index] = (crc == expected);
+            });
+            index++;
+        }
+        wait_replies();
+
+        const auto mismatched = std::count(same.begin(), same.end(), false);
+        reportMessage(QStringLiteral("CRC mismatch in %1 pages of %2").arg(mismatched).arg(pages.size()));
+    }
+
     uint8_t counter = 0;
     bool differs = false;
     char line[128];
     int line_offset = 0;
     uint32_t pos = 0;
+    size_t index = 0;
+    std::vector<uint8_t> device;
     for(const auto &[page_addr, page] : pages)
     {
-        const size_t size = page.data.size();
-        for(size_t i = 0; i < size; i++)
+        if ( m_cancel )
         {
-            if ( m_cancel )
-            {
-                isp_program_disable();
-                endProgress();
-                throw nano::exception("canceled");
-            }
+            isp_program_disable();
+            endProgress();
+            throw nano::exception("canceled");
+        }
 
-            reportProgress(pos++);
+        const size_t size = page.data.size();
+        if ( same[index++] )
+        {
+            device.assign(page.data.begin(), page.data.end());
+        }
+        else
+        {
+            device.resize(size);
+            isp_read_memory(page_addr, device.data(), size);
+        }
 
+        for(size_t i = 0; i < size; i++)
+        {
             const uint32_t addr = page_addr + i;
             if ( counter == 0 )
             {
                 line_offset = sprintf(line, "MEM[0x%04X]", addr);
             }
-            uint8_t byte = isp_read_memory(addr);
+            const uint8_t byte = device[i];
             line[line_offset++] = (page.data[i] == byte ? '.' : '*' );
             if ( page.data[i] != byte ) differs = true;
             if ( counter == 0x1F )
@@ -264,12 +508,16 @@ void AVR::isp_check_firmware(const FirmwareData &pages)
                 reportMessage(QString::fromUtf8(line, line_offset));
             }
             counter = (counter + 1) & 0x1F;
-
-            reportProgress(addr);
-            QCoreApplication::processEvents();
         }
+
+        pos += size;
+        reportProgress(pos);
+        QCoreApplication::processEvents();
     }
 
+    // EEPROM сверяем в том же сеансе программирования
+    if ( !eeprom.empty() && !check_eeprom(eeprom) ) differs = true;
+
     isp_program_disable();
 
     if ( differs )
@@ -296,7 +544,9 @@ void AVR::isp_write_firmware(const FirmwareData &pages)
         return;
     }
 
-    beginProgress(0, pages.getDataSize());
+    const FirmwareData eeprom = eeprom_image();
+
+    beginProgress(0, pages.getDataSize() + eeprom.getDataSize());
 
     isp_program_enable();
 
@@ -305,7 +555,7 @@ void AVR::isp_write_firmware(const FirmwareData &pages)
         throw nano::exception("isp_write_firmware() reject: wrong chip signature");
     }
 
-    if ( !avr.valid() || !avr.paged )
+    if ( !avr.valid() )
     {
         throw nano::exception("isp_write_firmware() reject: unsupported chip");
     }
@@ -316,36 +566,61 @@ void AVR::isp_write_firmware(const FirmwareData &pages)
     char line[128];
     int line_len = 0;
     uint32_t pos = 0;
+    uint32_t skipped = 0;
     for(const auto &[page_addr, page] : pages)
     {
+        if ( m_cancel )
+        {
+            isp_program_disable();
+            endProgress();
+            throw nano::exception("canceled");
+        }
+
+        // после стирания чипа страница и так заполнена 0xFF
         const size_t size = page.data.size();
+        const bool blank = page.blank();
+        if ( blank ) skipped++;
+        else if ( avr.paged ) isp_program_page(page_addr, page.data.data(), size);
+        else isp_program_bytes(page_addr, page.data.data(), size);
+
         for(size_t i = 0; i < size; i++)
         {
-            if ( m_cancel )
-            {
-                isp_program_disable();
-                endProgress();
-                throw nano::exception("canceled");
-            }
-
-            reportProgress(pos++);
             const uint32_t addr = page_addr + i;
             if ( counter == 0 )
             {
                 line_len = sprintf(line, "MEM[0x%04X]", addr);
             }
-            isp_load_memory_page(addr, page.data[i]);
-            line[line_len++] = '.';
+            line[line_len++] = blank ? ' ' : '.';
             if ( counter == 0x1F )
             {
                 reportMessage(QString::fromUtf8(line, line_len));
             }
             counter = (counter + 1) & 0x1F;
         }
-        isp_write_memory_page(page_addr);
+
+        pos += size;
+        reportProgress(pos);
     }
 
+    if ( skipped )
+    {
+        reportMessage(QStringLiteral("skipped %1 blank pages").arg(skipped));
+    }
 
+    // EEPROM пишем в том же сеансе программирования, после флеш
+    if ( !eeprom.empty() )
+    {
+        try
+        {
+            write_eeprom(eeprom, pos);
+        }
+        catch (...)
+        {
+            isp_program_disable();
+            endProgress();
+            throw;
+        }
+    }
 
     isp_program_disable();
 
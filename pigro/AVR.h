@@ -5,8 +5,11 @@
 #include <array>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <functional>
 
 #include <nano/exception.h>
+#include <QThread>
 
 #include "PigroLink.h"
 #include "PigroDriver.h"
@@ -38,6 +41,26 @@ public:
         uint32_t eeprom_page_size;
         uint32_t eeprom_page_count;
 
+        /**
+         * Время записи страницы flash, байта/страницы EEPROM и стирания
+         * чипа в микросекундах (max_write_delay/chip_erase_delay из
+         * avrdude), используются если нет Poll RDY/BSY
+         */
+        uint32_t flash_write_delay;
+        uint32_t eeprom_write_delay;
+        uint32_t chip_erase_delay;
+
+        /**
+         * Чип поддерживает команду Poll RDY/BSY (0xF0)
+         */
+        bool rdy_bsy;
+
+        /**
+         * Что читается из флеш во время побайтовой записи (readback_p1
+         * из avrdude), по нему адаптер определяет окончание записи
+         */
+        uint8_t flash_readback;
+
         bool valid() const
         {
             if ( page_word_size == 0 || page_count == 0 ) return false;
@@ -45,8 +68,9 @@ public:
 
             if ( type == "avr")
             {
+                // адрес слова - 16 бит плюс Extended Address Byte (0x4D)
                 uint32_t size = flash_size();
-                return (size > 0) && (size < 0x20000);
+                return (size > 0) && (size <= 0x2000000);
             }
 
             if ( type == "arm" )
@@ -60,11 +84,44 @@ public:
         uint32_t flash_size() const { return page_byte_size() * page_count; }
         uint32_t eeprom_size() const { return eeprom_page_size * eeprom_page_count; }
 
+        /**
+         * EEPROM пишется страницами (0xC1/0xC2), иначе только побайтно (0xC0)
+         */
+        bool eeprom_paged() const { return eeprom_page_size > 1; }
+
         uint32_t page_byte_size() const { return page_word_size * 2; }
     };
 
     AvrDeviceInfo avr;
 
+    /**
+     * Текущий Extended Address Byte чипа (команда 0x4D)
+     *
+     * После сброса чипа 0, поэтому у чипов до 128 КБ команда 0x4D
+     * никогда не подается
+     */
+    uint8_t m_ext_addr { 0 };
+
+    /**
+     * Тактовая частота адаптера, от нее считается частота SCK
+     */
+    static constexpr uint32_t ADAPTER_F_CPU = 7372800;
+
+    /**
+     * Индексы частоты SCK команды isp_clock: fosc/128 ... fosc/2
+     */
+    static constexpr uint8_t ISP_CLOCK_MAX = 6;
+
+    static constexpr uint32_t isp_clock_hz(uint8_t index)
+    {
+        return ADAPTER_F_CPU / (128 >> index);
+    }
+
+    /**
+     * Выбранная частота SCK, -1 - еще не подбиралась в этом сеансе
+     */
+    int m_isp_clock { -1 };
+
     AVR(PigroLink *link, Pigro *owner);
     AVR(const AVR &) = delete;
     AVR(AVR &&) = delete;
@@ -89,9 +146,9 @@ public:
     }
 
     /**
-     * Отправить команду программирования (ISP)
+     * Пакет команды программирования (ISP)
      */
-    unsigned int cmd_isp_io(unsigned int cmd)
+    static packet_t isp_io_packet(unsigned int cmd)
     {
         packet_t pkt;
         pkt.cmd = 3;
@@ -104,32 +161,77 @@ public:
             cmd <<= 8;
         }
 
-        send_packet(pkt);
+        return pkt;
+    }
 
-        recv_packet(pkt);
-        if ( pkt.cmd != 3 || pkt.len != 4 ) throw nano::exception("unexpected packet");
+    /**
+     * Разобрать ответ на команду программирования (ISP)
+     */
+    static unsigned int parse_isp_io(const bulk_t &reply)
+    {
+        if ( reply.cmd != 3 || reply.data.size() != 4 ) throw nano::exception("unexpected packet");
 
         unsigned int result = 0;
-        for(int i = 0; i < 4; i++)
+        for(unsigned char byte : reply.data)
         {
-            unsigned char byte = pkt.data[i];
             result = result * 256 + byte;
         }
 
         return result;
     }
 
+    /**
+     * Отправить команду программирования (ISP) не дожидаясь ответа
+     */
+    void send_isp_io(unsigned int cmd)
+    {
+        send_packet(isp_io_packet(cmd));
+    }
+
+    /**
+     * Прочитать ответ на команду программирования (ISP)
+     */
+    unsigned int recv_isp_io()
+    {
+        bulk_t reply;
+        recv_packet(reply);
+        return parse_isp_io(reply);
+    }
+
+    /**
+     * Отправить команду программирования (ISP)
+     */
+    unsigned int cmd_isp_io(unsigned int cmd)
+    {
+        send_isp_io(cmd);
+        return recv_isp_io();
+    }
+
     /**
      * @brief Подать сигнал RESET и командду "Programming Enable"
      * @return
      */
     int isp_program_enable()
     {
-        cmd_isp_reset(0);
-        cmd_isp_reset(1);
-        cmd_isp_reset(0);
+        // адаптер помнит частоту SCK с прошлого сеанса, подбор
+        // всегда начинаем с самой медленной
+        const bool tune = m_isp_clock < 0 && bulk_size() > 0;
+        if ( tune ) cmd_isp_clock(0);
+
+        // импульс RESET и не менее 20 мс до "Programming Enable"
+        // по даташиту, все одним обменом
+        PigroBatch b = batch();
+        b.isp_reset(0);
+        b.isp_reset(1);
+        b.isp_reset(0);
+        b.pause(20);
+
+        uint32_t r;
+        b.isp_io(0xAC530000, r);
+        b.exec();
+
+        m_ext_addr = 0;
 
-        unsigned int r = cmd_isp_io(0xAC530000);
         int status = (r & 0xFF00) == 0x5300;
         if ( /* verbose || */ !status )
         {
@@ -140,9 +242,41 @@ public:
         {
             throw nano::exception("isp_program_enable() failed");
         }
+
+        if ( tune ) isp_tune_clock();
+
         return status;
     }
 
+    /**
+     * Установить частоту SCK адаптера (команда isp_clock)
+     */
+    void cmd_isp_clock(uint8_t index)
+    {
+        packet_t pkt;
+        pkt.cmd = 26;
+        pkt.len = 1;
+        pkt.data[0] = index;
+
+        const bulk_t reply = transact(pkt);
+        if ( reply.cmd != 26 || reply.data.size() != 1 ) throw nano::exception("cmd_isp_clock(): unexpected packet");
+        if ( reply.data[0] != index ) throw nano::exception("cmd_isp_clock(): wrong clock index " + std::to_string(index));
+    }
+
+    /**
+     * Максимальный индекс частоты SCK с учетом параметра isp_clock
+     */
+    uint8_t isp_clock_limit();
+
+    /**
+     * Подобрать частоту SCK
+     *
+     * Поднимаем частоту по шагам, на каждом шаге проверяем эхо
+     * "Programming Enable" и сигнатуру чипа. Останавливаемся на
+     * последней частоте, где все сошлось
+     */
+    void isp_tune_clock();
+
     /**
      * Завершить программирование
      */
@@ -160,11 +294,15 @@ public:
      */
     DeviceCode isp_read_chip_info()
     {
-        uint8_t b000 = cmd_isp_io(0x30000000) & 0xFF;
-        uint8_t b001 = cmd_isp_io(0x30000100) & 0xFF;
-        uint8_t b002 = cmd_isp_io(0x30000200) & 0xFF;
+        DeviceCode code;
+        PigroBatch b = batch();
+        for(uint8_t i = 0; i < code.size(); i++)
+        {
+            b.isp_io(0x30000000 | (i << 8), [&code, i] (uint32_t r) { code[i] = r & 0xFF; });
+        }
+        b.exec();
 
-        return {b000, b001, b002};
+        return code;
     }
 
     static DeviceCode parseDeviceCode(const std::string &code)
@@ -186,76 +324,561 @@ public:
         return status;
     }
 
+    /**
+     * Перевести задержку в микросекундах в периоды таймера адаптера
+     */
+    static uint16_t delay_ticks(uint32_t usecs)
+    {
+        constexpr uint32_t tick_us = 272;
+        return std::min<uint32_t>((usecs + tick_us - 1) / tick_us, 0xFFFF);
+    }
+
+    /**
+     * Выполнить команду программирования и дождаться ее завершения
+     *
+     * Если чип поддерживает Poll RDY/BSY, то адаптер опрашивает его
+     * (с таймаутом в несколько раз больше паспортного времени), иначе
+     * просто выжидает delay. Старый адаптер не умеет isp_io_wait,
+     * тогда ждем на стороне хоста.
+     *
+     * @param delay паспортное время операции в микросекундах
+     */
+    uint32_t isp_io_wait(uint32_t cmd, uint32_t delay)
+    {
+        if ( proto_version() < 1 )
+        {
+            const uint32_t r = cmd_isp_io(cmd);
+            QThread::usleep(delay);
+            return r;
+        }
+
+        const uint16_t ticks = avr.rdy_bsy ? delay_ticks(std::max<uint32_t>(delay * 4, 20000)) : delay_ticks(delay);
+
+        packet_t pkt = isp_io_packet(cmd);
+        pkt.cmd = 21;
+        pkt.len = 7;
+        pkt.data[4] = avr.rdy_bsy ? 1 : 0;
+        pkt.data[5] = ticks & 0xFF;
+        pkt.data[6] = ticks >> 8;
+
+        const bulk_t reply = transact(pkt);
+        if ( reply.cmd != 21 || reply.data.size() != 5 ) throw nano::exception("isp_io_wait(): unexpected packet");
+        if ( reply.data[4] != 0 ) throw nano::exception("isp_io_wait(): busy timeout");
+
+        uint32_t result = 0;
+        for(int i = 0; i < 4; i++) result = result * 256 + reply.data[i];
+        return result;
+    }
+
+    /**
+     * Выждать паспортное время операции, если чип не поддерживает
+     * Poll RDY/BSY (задержка выполняется адаптером, в порядке команд)
+     */
+    void isp_delay(uint32_t usecs)
+    {
+        PigroBatch b = batch();
+        b.pause((usecs + 999) / 1000);
+        b.exec();
+    }
+
     bool chip_erase()
     {
-        unsigned int r = cmd_isp_io(0xAC800000);
+        unsigned int r = isp_io_wait(0xAC800000, avr.chip_erase_delay);
         bool status = ((r >> 16) & 0xFF) == 0xAC;
         if ( !status ) error("isp_chip_erase() error");
         return status;
     }
 
     /**
-     * Прочитать байт прошивки из устройства
+     * Старший байт адреса слова (для команды 0x4D) по байтовому адресу
+     */
+    static uint8_t extended_address(uint32_t addr)
+    {
+        return (addr >> 17) & 0xFF;
+    }
+
+    /**
+     * Команда "Load Extended Address Byte", подается только если
+     * старший байт адреса изменился
+     *
+     * Команда синхронная, но может идти вперемешку с transact(),
+     * адаптер выполняет команды по порядку
+     */
+    void isp_extended_address(uint32_t addr)
+    {
+        const uint8_t ext = extended_address(addr);
+        if ( ext == m_ext_addr ) return;
+
+        const uint32_t r = parse_isp_io( transact(isp_io_packet(0x4D000000 | (ext << 8))) );
+        if ( ((r >> 16) & 0xFF) != 0x4D ) throw nano::exception("isp_extended_address() error");
+        m_ext_addr = ext;
+    }
+
+    /**
+     * Команда "Read Program Memory"
+     *
+     * Старший байт адреса слова задается отдельно, см. isp_extended_address()
      */
-    uint8_t isp_read_memory(uint16_t addr)
+    static uint32_t read_memory_cmd(uint32_t addr)
     {
         uint8_t cmd = (addr & 1) ? 0x28 : 0x20;
-        uint16_t offset = (addr >> 1);
-        return cmd_isp_io( (cmd << 24) | (offset << 8 ) ) & 0xFF;
+        uint16_t offset = (addr >> 1) & 0xFFFF;
+        return (cmd << 24) | (offset << 8 );
     }
 
     /**
-     * Загрузить байт прошивки в буфер страницы
+     * Прочитать байт прошивки из устройства
+     */
+    uint8_t isp_read_memory(uint32_t addr)
+    {
+        isp_extended_address(addr);
+        return cmd_isp_io( read_memory_cmd(addr) ) & 0xFF;
+    }
+
+    /**
+     * Команда "Read EEPROM Memory"
+     */
+    static uint32_t read_eeprom_cmd(uint16_t addr)
+    {
+        return (0xA0 << 24) | (addr << 8);
+    }
+
+    /**
+     * Память для isp_read_block и isp_crc
+     */
+    static constexpr uint8_t ISP_MEMORY_FLASH = 0;
+    static constexpr uint8_t ISP_MEMORY_EEPROM = 1;
+
+    /**
+     * Прочитать блок прошивки одной командой адаптера (isp_read_block)
+     *
+     * Адаптер сам подает 0x20/0x28 (для EEPROM 0xA0) для каждого байта
+     * и возвращает результат большими пакетами
+     */
+    void isp_read_block(uint32_t addr, uint8_t *data, size_t size, uint8_t memory = ISP_MEMORY_FLASH)
+    {
+        packet_t pkt;
+        pkt.cmd = 20;
+        pkt.len = (memory == ISP_MEMORY_FLASH) ? 5 : 6;
+        pkt.data[0] = addr & 0xFF;
+        pkt.data[1] = (addr >> 8) & 0xFF;
+        pkt.data[2] = (addr >> 16) & 0xFF;
+        pkt.data[3] = size & 0xFF;
+        pkt.data[4] = (size >> 8) & 0xFF;
+        pkt.data[5] = memory;
+
+        // адаптер режет ответ на большие пакеты по bulk_size байт
+        send_packet(pkt, (size + bulk_size() - 1) / bulk_size());
+
+        // адаптер сам подает 0x4D по ходу чтения
+        if ( memory == ISP_MEMORY_FLASH && size > 0 ) m_ext_addr = extended_address(addr + size - 1);
+
+        size_t pos = 0;
+        while ( pos < size )
+        {
+            bulk_t reply;
+            recv_packet(reply);
+            if ( reply.cmd != 20 || reply.data.empty() || pos + reply.data.size() > size )
+            {
+                throw nano::exception("isp_read_block(): unexpected packet");
+            }
+            std::copy(reply.data.begin(), reply.data.end(), data + pos);
+            pos += reply.data.size();
+        }
+    }
+
+    /**
+     * Максимальный размер блока для isp_read_block()
+     */
+    static constexpr size_t ISP_READ_BLOCK_MAX = 0xFFFF;
+
+    /**
+     * Прочитать блок прошивки из устройства
+     *
+     * Если адаптер поддерживает большие пакеты, то блок читается командой
+     * isp_read_block, иначе команды ставятся в очередь через transact()
+     * и ответы раскладываются по мере поступления
+     */
+    void isp_read_memory(uint32_t addr, uint8_t *data, size_t size)
+    {
+        if ( bulk_size() > 0 )
+        {
+            for(size_t offset = 0; offset < size; offset += ISP_READ_BLOCK_MAX)
+            {
+                isp_read_block(addr + offset, data + offset, std::min(ISP_READ_BLOCK_MAX, size - offset));
+            }
+            return;
+        }
+
+        for(size_t i = 0; i < size; i++)
+        {
+            isp_extended_address(addr + i);
+            transact(isp_io_packet( read_memory_cmd(addr + i) ), [data, i] (const bulk_t &reply) {
+                data[i] = parse_isp_io(reply) & 0xFF;
+            });
+        }
+        wait_replies();
+    }
+
+    /**
+     * Прочитать блок EEPROM из устройства
+     */
+    void isp_read_eeprom(uint32_t addr, uint8_t *data, size_t size)
+    {
+        if ( bulk_size() > 0 )
+        {
+            for(size_t offset = 0; offset < size; offset += ISP_READ_BLOCK_MAX)
+            {
+                isp_read_block(addr + offset, data + offset, std::min(ISP_READ_BLOCK_MAX, size - offset), ISP_MEMORY_EEPROM);
+            }
+            return;
+        }
+
+        for(size_t i = 0; i < size; i++)
+        {
+            transact(isp_io_packet( read_eeprom_cmd(addr + i) ), [data, i] (const bulk_t &reply) {
+                data[i] = parse_isp_io(reply) & 0xFF;
+            });
+        }
+        wait_replies();
+    }
+
+    /**
+     * Запросить CRC-32 блока флеш-памяти или EEPROM (команда isp_crc)
+     *
+     * Адаптер сам читает память, по линии передается только CRC. Ответ
+     * приходит в handler, результатов дожидаемся через wait_replies()
      */
-    void isp_load_memory_page(uint16_t addr, uint8_t byte)
+    void isp_crc(uint32_t addr, size_t size, std::function<void(uint32_t crc)> handler, uint8_t memory = ISP_MEMORY_FLASH)
+    {
+        packet_t pkt;
+        pkt.cmd = 24;
+        pkt.len = (memory == ISP_MEMORY_FLASH) ? 5 : 6;
+        pkt.data[0] = addr & 0xFF;
+        pkt.data[1] = (addr >> 8) & 0xFF;
+        pkt.data[2] = (addr >> 16) & 0xFF;
+        pkt.data[3] = size & 0xFF;
+        pkt.data[4] = (size >> 8) & 0xFF;
+        pkt.data[5] = memory;
+        if ( memory == ISP_MEMORY_FLASH && size > 0 ) m_ext_addr = extended_address(addr + size - 1);
+        transact(pkt, [handler] (const bulk_t &reply) {
+            if ( reply.cmd != 24 || reply.data.size() != 4 ) throw nano::exception("isp_crc(): unexpected packet");
+            handler(reply.data[0] | (reply.data[1] << 8) | (reply.data[2] << 16) | (uint32_t(reply.data[3]) << 24));
+        });
+    }
+
+    /**
+     * Команда "Load Program Memory Page"
+     */
+    static uint32_t load_memory_page_cmd(uint32_t addr, uint8_t byte)
     {
         uint8_t cmd = (addr & 1) ? 0x48 : 0x40;
-        //uint16_t offset = (addr >> 1);
-        uint16_t word_addr = (addr >> 1);
-        uint32_t result = cmd_isp_io( (cmd << 24) | (word_addr << 8 ) | (byte & 0xFF) );
+        uint16_t word_addr = (addr >> 1) & 0xFFFF;
+        return (cmd << 24) | (word_addr << 8 ) | (byte & 0xFF);
+    }
+
+    static void check_load_memory_page(uint32_t cmd, uint32_t result)
+    {
         uint8_t r = (result >> 16) & 0xFF;
-        int status = (r == cmd);
+        int status = (r == (cmd >> 24));
         if ( !status ) throw nano::exception("isp_load_memory_page() error");
     }
 
+    /**
+     * Загрузить байт прошивки в буфер страницы
+     */
+    void isp_load_memory_page(uint32_t addr, uint8_t byte)
+    {
+        const uint32_t cmd = load_memory_page_cmd(addr, byte);
+        check_load_memory_page(cmd, cmd_isp_io(cmd));
+    }
+
+    /**
+     * Загрузить блок прошивки в буфер страницы
+     *
+     * В оконном режиме сначала отправляются все команды загрузки,
+     * затем проверяются ответы
+     */
+    void isp_load_memory_page(uint32_t addr, const uint8_t *data, size_t size)
+    {
+        // загружаем все байты: содержимое буфера страницы после записи
+        // не определено, стертые страницы целиком пропускает вызывающий
+        if ( !windowed() )
+        {
+            for(size_t i = 0; i < size; i++)
+            {
+                isp_load_memory_page(addr + i, data[i]);
+            }
+            return;
+        }
+
+        for(size_t i = 0; i < size; i++)
+        {
+            send_isp_io( load_memory_page_cmd(addr + i, data[i]) );
+        }
+        for(size_t i = 0; i < size; i++)
+        {
+            check_load_memory_page(load_memory_page_cmd(addr + i, data[i]), recv_isp_io());
+        }
+    }
+
+    /**
+     * Флаги команды isp_load_page
+     */
+    static constexpr uint8_t ISP_PAGE_WRITE = 1;
+    static constexpr uint8_t ISP_PAGE_WAIT = 2;
+    static constexpr uint8_t ISP_PAGE_EEPROM = 4;
+
+    /**
+     * Загрузить блок в буфер страницы одной командой адаптера
+     *
+     * Адаптер сам подает 0x40/0x48 для каждого байта и, в зависимости
+     * от флагов, записывает страницу (0x4C) и ждет готовности чипа.
+     * С флагом ISP_PAGE_EEPROM - то же для EEPROM командами 0xC1/0xC2
+     *
+     * @param addr байтовый адрес начала блока, для флеш должен быть четным
+     */
+    void isp_load_page_block(uint32_t addr, const uint8_t *data, size_t size, uint8_t flags)
+    {
+        const bool eeprom = flags & ISP_PAGE_EEPROM;
+        if ( !eeprom && (addr & 1) ) throw nano::exception("isp_load_page_block(): unaligned address");
+
+        if ( !eeprom ) isp_extended_address(addr);
+
+        const uint16_t word_addr = eeprom ? addr : (addr / 2) & 0xFFFF;
+        std::vector<uint8_t> request(size + 3);
+        request[0] = flags;
+        request[1] = word_addr & 0xFF;
+        request[2] = word_addr >> 8;
+        std::copy(data, data + size, request.begin() + 3);
+
+        bulk_t reply;
+        send_packet(19, request.data(), request.size());
+        recv_packet(reply);
+        if ( reply.cmd != 19 || reply.data.size() != 3 ) throw nano::exception("isp_load_page_block(): unexpected packet");
+
+        const uint16_t offset = reply.data[1] | (reply.data[2] << 8);
+        switch ( reply.data[0] )
+        {
+        case 0: return;
+        case 1: throw nano::exception("isp_load_memory_page() error at " + std::to_string(addr + offset));
+        case 2: throw nano::exception("isp_write_memory_page() error at " + std::to_string(addr));
+        case 3: throw nano::exception("isp_write_memory_page() busy timeout at " + std::to_string(addr));
+        default: throw nano::exception("isp_load_page_block(): wrong status: " + std::to_string(reply.data[0]));
+        }
+    }
+
+    /**
+     * Загрузить и записать страницу прошивки
+     *
+     * Если адаптер поддерживает большие пакеты, то страница уходит одним
+     * (или несколькими, если не влезает) пакетом isp_load_page, иначе
+     * по одной команде на байт
+     */
+    void isp_program_page(uint32_t page_addr, const uint8_t *data, size_t size)
+    {
+        const size_t chunk = bulk_size() > 3 ? (bulk_size() - 3) & ~size_t(1) : 0;
+        if ( chunk == 0 )
+        {
+            // страница не пересекает границу 128 КБ, старший байт адреса общий
+            isp_extended_address(page_addr);
+            isp_load_memory_page(page_addr, data, size);
+            if ( !isp_write_memory_page(page_addr) ) throw nano::exception("isp_write_memory_page() error");
+            return;
+        }
+
+        const uint8_t write_flags = avr.rdy_bsy ? (ISP_PAGE_WRITE | ISP_PAGE_WAIT) : ISP_PAGE_WRITE;
+        for(size_t offset = 0; offset < size; offset += chunk)
+        {
+            const size_t n = std::min(chunk, size - offset);
+            const uint8_t flags = (offset + n >= size) ? write_flags : 0;
+            isp_load_page_block(page_addr + offset, data + offset, n, flags);
+        }
+
+        if ( !avr.rdy_bsy ) isp_delay(avr.flash_write_delay);
+    }
+
+    /**
+     * Записать страницу EEPROM
+     *
+     * Страничная EEPROM загружается командой 0xC1 и пишется командой
+     * 0xC2 (одним пакетом isp_load_page, если адаптер умеет), иначе
+     * каждый байт пишется командой 0xC0 с ожиданием готовности
+     */
+    void isp_program_eeprom_page(uint32_t page_addr, const uint8_t *data, size_t size)
+    {
+        if ( !avr.eeprom_paged() )
+        {
+            for(size_t i = 0; i < size; i++)
+            {
+                const uint32_t addr = page_addr + i;
+                const uint32_t r = isp_io_wait((0xC0 << 24) | (addr << 8) | data[i], avr.eeprom_write_delay);
+                if ( ((r >> 16) & 0xFF) != 0xC0 ) throw nano::exception("isp_write_eeprom() error at " + std::to_string(addr));
+            }
+            return;
+        }
+
+        if ( bulk_size() > 3 && size + 3 <= bulk_size() )
+        {
+            const uint8_t flags = ISP_PAGE_EEPROM | ISP_PAGE_WRITE | (avr.rdy_bsy ? ISP_PAGE_WAIT : 0);
+            isp_load_page_block(page_addr, data, size, flags);
+            if ( !avr.rdy_bsy ) isp_delay(avr.eeprom_write_delay);
+            return;
+        }
+
+        for(size_t i = 0; i < size; i++)
+        {
+            const uint32_t cmd = (0xC1 << 24) | (((page_addr + i) & 0xFF) << 8) | data[i];
+            if ( ((cmd_isp_io(cmd) >> 16) & 0xFF) != 0xC1 ) throw nano::exception("isp_load_eeprom_page() error");
+        }
+        const uint32_t r = isp_io_wait((0xC2 << 24) | (page_addr << 8), avr.eeprom_write_delay);
+        if ( ((r >> 16) & 0xFF) != 0xC2 ) throw nano::exception("isp_write_eeprom_page() error at " + std::to_string(page_addr));
+    }
+
+    /**
+     * Размер условной страницы для чипов без страничной записи (байт)
+     */
+    static constexpr uint32_t BYTE_WRITE_GROUP = 64;
+
+    /**
+     * Сколько адаптер может писать байты одной командой isp_write_bytes
+     * (мкс): ответ должен прийти раньше таймаута чтения PigroLink (200 мс)
+     */
+    static constexpr uint32_t BYTE_WRITE_BUDGET = 100000;
+
+    /**
+     * Записать блок флеш побайтно (чипы без страничной записи)
+     *
+     * Если адаптер поддерживает большие пакеты, то блок уходит одним
+     * пакетом isp_write_bytes, адаптер сам пишет байты и опрашивает
+     * чип до окончания записи. Иначе каждый байт пишется отдельной
+     * командой, окончание записи хост определяет чтением байта
+     */
+    void isp_program_bytes(uint32_t addr, const uint8_t *data, size_t size)
+    {
+        const size_t chunk = bulk_size() > 4 ? bulk_size() - 4 : 0;
+        if ( chunk == 0 )
+        {
+            for(size_t i = 0; i < size; i++)
+            {
+                if ( data[i] != 0xFF ) isp_write_byte(addr + i, data[i]);
+            }
+            return;
+        }
+
+        // байт пишется до flash_write_delay (20 мс у AT90S4414/8515), адаптер
+        // молчит, пока не запишет весь пакет. Поэтому ограничиваем число
+        // записываемых байт в пакете, байты 0xFF адаптер пропускает
+        const uint8_t delay = std::min<uint16_t>(delay_ticks(avr.flash_write_delay), 0xFF);
+        const size_t max_writes = std::max<size_t>(1, BYTE_WRITE_BUDGET / std::max<uint32_t>(avr.flash_write_delay, 1));
+        for(size_t offset = 0, n = 0; offset < size; offset += n)
+        {
+            size_t writes = 0;
+            for(n = 0; offset + n < size && n < chunk; n++)
+            {
+                if ( data[offset + n] == 0xFF ) continue;
+                if ( writes == max_writes ) break;
+                writes++;
+            }
+
+            const uint32_t block_addr = addr + offset;
+
+            std::vector<uint8_t> request(n + 4);
+            request[0] = block_addr & 0xFF;
+            request[1] = (block_addr >> 8) & 0xFF;
+            request[2] = avr.flash_readback;
+            request[3] = delay;
+            std::copy(data + offset, data + offset + n, request.begin() + 4);
+
+            bulk_t reply;
+            send_packet(27, request.data(), request.size());
+            recv_packet(reply);
+            if ( reply.cmd != 27 || reply.data.size() != 3 ) throw nano::exception("isp_write_bytes(): unexpected packet");
+
+            const uint16_t error_offset = reply.data[1] | (reply.data[2] << 8);
+            if ( reply.data[0] != 0 ) throw nano::exception("isp_write_bytes() busy timeout at " + std::to_string(block_addr + error_offset));
+        }
+    }
+
+    /**
+     * Записать байт флеш командой "Write Program Memory" и дождаться
+     * окончания записи (старый адаптер)
+     */
+    void isp_write_byte(uint32_t addr, uint8_t byte)
+    {
+        cmd_isp_io( load_memory_page_cmd(addr, byte) );
+
+        if ( byte == avr.flash_readback )
+        {
+            QThread::usleep(avr.flash_write_delay);
+            return;
+        }
+
+        for(uint32_t waited = 0; isp_read_memory(addr) != byte; waited += 100)
+        {
+            if ( waited > avr.flash_write_delay * 4 ) throw nano::exception("isp_write_byte() busy timeout at " + std::to_string(addr));
+            QThread::usleep(100);
+        }
+    }
+
     /**
      * Записать буфер страницы
      */
-    int isp_write_memory_page(uint16_t page_addr)
+    int isp_write_memory_page(uint32_t page_addr)
     {
         uint8_t cmd = 0x4C;
-        uint32_t result = cmd_isp_io( (cmd << 24) | ((page_addr / 2) << 8 ) );
+        isp_extended_address(page_addr);
+        uint32_t result = isp_io_wait( (cmd << 24) | (((page_addr / 2) & 0xFFFF) << 8 ), avr.flash_write_delay );
         uint8_t r = (result >> 16) & 0xFF;
         int status = (r == cmd);
-        //sleep(1);
         return status;
     }
 
-    uint8_t isp_read_fuse_high()
+    static uint8_t check_fuse_echo(uint32_t r, uint8_t echo, const char *func)
     {
-        uint32_t r = cmd_isp_io(0x58080000);
-        uint8_t echo = (r >> 8) & 0xFF;
-        if ( echo != 0x08 ) throw nano::exception("isp_read_fuse_high() out of sync");
-
+        if ( ((r >> 8) & 0xFF) != echo ) throw nano::exception(std::string(func) + " out of sync");
         return r & 0xFF;
     }
 
-    uint8_t isp_read_fuse_low()
+    uint8_t isp_read_fuse_high()
     {
-        uint32_t r = cmd_isp_io(0x50000000);
-        uint8_t echo = (r >> 8) & 0xFF;
-        if ( echo != 0x00 ) throw nano::exception("isp_read_fuse_low() out of sync");
+        return check_fuse_echo(cmd_isp_io(0x58080000), 0x08, "isp_read_fuse_high()");
+    }
 
-        return r & 0xFF;
+    uint8_t isp_read_fuse_low()
+    {
+        return check_fuse_echo(cmd_isp_io(0x50000000), 0x00, "isp_read_fuse_low()");
     }
 
     uint8_t isp_read_fuse_ext()
     {
-        uint32_t r = cmd_isp_io(0x50080000);
-        uint8_t echo = (r >> 8) & 0xFF;
-        if ( echo != 0x08 ) throw nano::exception("isp_read_fuse_ext() out of sync");
+        return check_fuse_echo(cmd_isp_io(0x50080000), 0x08, "isp_read_fuse_ext()");
+    }
 
-        return r & 0xFF;
+    struct fuses_t
+    {
+        uint8_t low;
+        uint8_t high;
+        uint8_t ext;
+    };
+
+    /**
+     * Прочитать все fuse-биты одним обменом
+     */
+    fuses_t isp_read_fuses()
+    {
+        uint32_t lo, hi, ex;
+        PigroBatch b = batch();
+        b.isp_io(0x50000000, lo);
+        b.isp_io(0x58080000, hi);
+        b.isp_io(0x50080000, ex);
+        b.exec();
+
+        return {
+            check_fuse_echo(lo, 0x00, "isp_read_fuse_low()"),
+            check_fuse_echo(hi, 0x08, "isp_read_fuse_high()"),
+            check_fuse_echo(ex, 0x08, "isp_read_fuse_ext()")
+        };
     }
 
     void isp_write_fuse_low(uint8_t value)
@@ -309,6 +932,38 @@ public:
      * Проверить прошивку на корректность
      */
     bool check_firmware(const FirmwareData &pages, bool verbose);
+
+    /**
+     * Загрузить образ EEPROM (параметр eeprom в pigro.ini), если он указан
+     *
+     * Образ побайтовый (страница в 1 байт), в нем только байты из файла
+     */
+    FirmwareData eeprom_image() const;
+
+    /**
+     * Непрерывный участок образа EEPROM внутри одной страницы
+     */
+    struct eeprom_block_t
+    {
+        uint32_t addr;
+        std::vector<uint8_t> data;
+    };
+
+    /**
+     * Разбить образ EEPROM на непрерывные участки, не пересекающие
+     * границу страницы (блока 32 байта для побайтовой EEPROM)
+     */
+    std::vector<eeprom_block_t> eeprom_blocks(const FirmwareData &bytes) const;
+
+    /**
+     * Записать/сверить EEPROM, программирование уже должно быть включено
+     *
+     * Пишутся только байты, заданные в файле
+     *
+     * @param progress значение прогресса перед записью EEPROM
+     */
+    void write_eeprom(const FirmwareData &bytes, uint32_t progress);
+    bool check_eeprom(const FirmwareData &bytes);
     void check_fuse();
 
     void action_test() override;
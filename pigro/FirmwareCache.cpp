@@ -0,0 +1,190 @@
+#include "FirmwareCache.h"
+#include "FirmwareData.h"
+#include "FirmwareFile.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
+#include <nano/crc.h>
+#include <nano/exception.h>
+
+/**
+ * Заголовок файла кеша, числа в порядке байт хоста - кеш локальный
+ */
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t source_size;
+    uint32_t page_size;
+    uint32_t page_fill;
+    uint32_t segments;
+    uint32_t reserved;
+};
+
+/**
+ * Заголовок сегмента, за ним идут used_words слов битовой
+ * карты и size байт данных
+ */
+struct CacheSegment
+{
+    uint32_t base;
+    uint32_t size;
+    uint32_t used_words;
+    uint32_t reserved;
+};
+
+static constexpr char CACHE_MAGIC[4] = { 'P', 'G', 'I', 'C' };
+static constexpr uint32_t CACHE_VERSION = 1;
+
+static unsigned count_bits(uint64_t word)
+{
+    unsigned count = 0;
+    for(; word != 0; word &= word - 1) count++;
+    return count;
+}
+
+QString FirmwareCache::path()
+{
+    return QDir::homePath() + "/.pigro/cache";
+}
+
+void FirmwareCache::load(const QString &path, FirmwareImage &image, uint32_t base_address)
+{
+    QFile file(path);
+    if ( !file.open(QIODevice::ReadOnly) )
+    {
+        throw nano::exception(QStringLiteral("fail to open file: ").append(path));
+    }
+
+    QByteArray buffer;
+    const std::string_view content = FirmwareFile::readFile(file, buffer);
+    const FirmwareFile::Format format = FirmwareFile::detect(path, content);
+
+    const QString dir = FirmwareCache::path();
+    if ( content.size() < MIN_SIZE || !image.empty() || !QDir().mkpath(dir) )
+    {
+        FirmwareFile::load(path, content, image, base_address, format);
+        return;
+    }
+
+    const uint32_t params[4] = { image.page_size(), image.page_fill(), base_address, uint32_t(format) };
+    const uint64_t seed = nano::hash64(reinterpret_cast<const uint8_t*>(params), sizeof(params));
+    const uint64_t key = nano::hash64(reinterpret_cast<const uint8_t*>(content.data()), content.size(), seed);
+
+    char key_name[32];
+    snprintf(key_name, sizeof(key_name), "%016llx.img", static_cast<unsigned long long>(key));
+    const QString name = dir + "/" + key_name;
+
+    if ( read(name, key, content.size(), image) ) return;
+
+    FirmwareFile::load(path, content, image, base_address, format);
+
+    // образ уже загружен, запись в кеш - по возможности
+    try
+    {
+        if ( write(name, key, content.size(), image) ) evict(dir);
+    }
+    catch (const std::exception &)
+    {
+    }
+}
+
+bool FirmwareCache::read(const QString &name, uint64_t key, uint64_t source_size, FirmwareImage &image)
+{
+    QFile file(name);
+    if ( !file.open(QIODevice::ReadOnly) ) return false;
+
+    QByteArray buffer;
+    const std::string_view data = FirmwareFile::readFile(file, buffer);
+    if ( data.size() < sizeof(CacheHeader) ) return false;
+
+    CacheHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if ( memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION ) return false;
+    if ( header.key != key || header.source_size != source_size ) return false;
+    if ( header.page_size != image.m_page_size || header.page_fill != image.m_page_fill ) return false;
+
+    std::vector<FirmwareImage::Segment> segments;
+    size_t used_pages = 0;
+    size_t offset = sizeof(header);
+    for(uint32_t i = 0; i < header.segments; i++)
+    {
+        CacheSegment entry;
+        if ( data.size() - offset < sizeof(entry) ) return false;
+        memcpy(&entry, data.data() + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        const size_t pages = entry.size / header.page_size;
+        if ( entry.size % header.page_size != 0 || entry.used_words != (pages + 63) / 64 ) return false;
+
+        const size_t used_bytes = entry.used_words * sizeof(uint64_t);
+        if ( data.size() - offset < used_bytes + entry.size ) return false;
+
+        // данные сегмента копируются из отображения одним куском
+        FirmwareImage::Segment seg;
+        seg.base = entry.base;
+        seg.used.resize(entry.used_words);
+        memcpy(seg.used.data(), data.data() + offset, used_bytes);
+        offset += used_bytes;
+
+        const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data.data() + offset);
+        seg.data.assign(bytes, bytes + entry.size);
+        offset += entry.size;
+
+        for(uint64_t word : seg.used) used_pages += count_bits(word);
+        segments.push_back(std::move(seg));
+    }
+
+    image.segments = std::move(segments);
+    image.m_used_pages = used_pages;
+
+    // время изменения - время последнего использования для вытеснения
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    return true;
+}
+
+bool FirmwareCache::write(const QString &name, uint64_t key, uint64_t source_size, const FirmwareImage &image)
+{
+    // QSaveFile пишет во временный файл и переименовывает его, параллельно
+    // работающие pigro не увидят недописанную запись
+    QSaveFile file(name);
+    if ( !file.open(QIODevice::WriteOnly) ) return false;
+
+    CacheHeader header {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.source_size = source_size;
+    header.page_size = image.m_page_size;
+    header.page_fill = image.m_page_fill;
+    header.segments = image.segments.size();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for(const FirmwareImage::Segment &seg : image.segments)
+    {
+        CacheSegment entry {};
+        entry.base = seg.base;
+        entry.size = seg.data.size();
+        entry.used_words = seg.used.size();
+        file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        file.write(reinterpret_cast<const char*>(seg.used.data()), seg.used.size() * sizeof(uint64_t));
+        file.write(reinterpret_cast<const char*>(seg.data.data()), seg.data.size());
+    }
+
+    return file.commit();
+}
+
+void FirmwareCache::evict(const QString &dir)
+{
+    // самые свежие записи первыми, все что не влезает в лимит - удаляем
+    qint64 total = 0;
+    for(const QFileInfo &info : QDir(dir).entryInfoList(QStringList { "*.img" }, QDir::Files, QDir::Time))
+    {
+        total += info.size();
+        if ( total > SIZE_LIMIT ) QFile::remove(info.absoluteFilePath());
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PIGRO_FIRMWARE_CACHE_H
+#define PIGRO_FIRMWARE_CACHE_H
+
+#include <QString>
+#include <cstdint>
+
+class FirmwareImage;
+
+/**
+ * Кеш разобранных образов прошивки в ~/.pigro/cache
+ *
+ * Ключ - хеш содержимого файла прошивки вместе с параметрами разбора
+ * (page_size, page_fill, base_address, формат), значение - двоичный
+ * снимок сегментов FirmwareImage. При серийной прошивке одного файла
+ * он разбирается один раз, дальше образ читается из кеша.
+ *
+ * Записи вытесняются по времени последнего использования, когда
+ * суммарный размер кеша превышает SIZE_LIMIT. Файлы меньше MIN_SIZE
+ * разбираются быстрее, чем хешируются и копируются, их не кешируем.
+ *
+ * Кеш включается опцией cache = yes в pigro.ini
+ */
+class FirmwareCache
+{
+public:
+
+    static constexpr qint64 SIZE_LIMIT = 64 * 1024 * 1024;
+    static constexpr size_t MIN_SIZE = 64 * 1024;
+
+    /**
+     * Каталог кеша
+     */
+    static QString path();
+
+    /**
+     * Загрузить прошивку через кеш
+     *
+     * Ошибки самого кеша не мешают загрузке - файл просто
+     * разбирается заново, а не записанная в кеш запись пропускается
+     */
+    static void load(const QString &path, FirmwareImage &image, uint32_t base_address = 0);
+
+private:
+
+    static bool read(const QString &name, uint64_t key, uint64_t source_size, FirmwareImage &image);
+    static bool write(const QString &name, uint64_t key, uint64_t source_size, const FirmwareImage &image);
+    static void evict(const QString &dir);
+
+};
+
+#endif // PIGRO_FIRMWARE_CACHE_H
@@ -1,68 +1,255 @@
 #include "FirmwareData.h"
+#include "FirmwareCache.h"
+#include "FirmwareFile.h"
 
-uint32_t FirmwareData::getDataSize() const
+#include <nano/string.h>
+
+FirmwareImage FirmwareImage::LoadFromFile(const std::string &path, uint32_t page_size, const uint8_t page_fill, uint32_t base_address, bool cache)
+{
+    FirmwareImage pages(page_size, page_fill);
+    if ( cache ) FirmwareCache::load(QString::fromStdString(path), pages, base_address);
+    else FirmwareFile::load(QString::fromStdString(path), pages, base_address);
+    return pages;
+}
+
+/**
+ * Номер младшего установленного бита, word != 0
+ */
+static unsigned lowest_bit(uint64_t word)
 {
-    uint32_t size { 0 };
-    for(const auto &it : *this)
+    unsigned bit = 0;
+    if ( (word & 0xFFFFFFFF) == 0 ) { word >>= 32; bit += 32; }
+    if ( (word & 0xFFFF) == 0 ) { word >>= 16; bit += 16; }
+    if ( (word & 0xFF) == 0 ) { word >>= 8; bit += 8; }
+    while ( (word & 1) == 0 ) { word >>= 1; bit++; }
+    return bit;
+}
+
+void FirmwareImage::const_iterator::skip()
+{
+    const auto &segments = image->segments;
+    for(; segment < segments.size(); segment++, page = 0)
     {
-        size += it.second.page_size();
+        const Segment &seg = segments[segment];
+        for(size_t w = page / 64; w < seg.used.size(); w++)
+        {
+            const uint64_t bits = (w == page / 64) ? (seg.used[w] >> (page % 64)) << (page % 64) : seg.used[w];
+            if ( bits != 0 )
+            {
+                page = w * 64 + lowest_bit(bits);
+                return;
+            }
+        }
     }
+    page = 0;
+}
 
-    return size;
+void FirmwareImage::mark_used(Segment &seg, size_t page)
+{
+    uint64_t &word = seg.used[page / 64];
+    const uint64_t mask = uint64_t(1) << (page % 64);
+    if ( (word & mask) == 0 )
+    {
+        word |= mask;
+        m_used_pages++;
+    }
 }
 
-std::vector<uint8_t> FirmwareData::getDataDump() const
+FirmwareImage::Segment& FirmwareImage::reserve(uint64_t start, uint64_t stop)
+{
+    // первый сегмент, который кончается не раньше start - SEGMENT_GAP
+    auto it = std::find_if(segments.begin(), segments.end(), [start] (const Segment &seg) {
+        return seg.end() + SEGMENT_GAP >= start;
+    });
+
+    if ( it == segments.end() || it->base > stop + SEGMENT_GAP )
+    {
+        Segment seg;
+        seg.base = start;
+        seg.data.assign(stop - start, m_page_fill);
+        seg.used.assign(((stop - start) / m_page_size + 63) / 64, 0);
+        return *segments.insert(it, std::move(seg));
+    }
+
+    const uint64_t new_base = std::min<uint64_t>(it->base, start);
+    uint64_t new_end = std::max(it->end(), stop);
+    auto last = std::next(it);
+    while ( last != segments.end() && last->base <= new_end + SEGMENT_GAP )
+    {
+        new_end = std::max(new_end, last->end());
+        ++last;
+    }
+
+    const size_t new_pages = (new_end - new_base) / m_page_size;
+
+    // обычный случай - записи HEX идут по возрастанию адресов,
+    // сегмент просто растет в конец
+    if ( new_base == it->base && last == std::next(it) )
+    {
+        it->data.resize(new_end - new_base, m_page_fill);
+        it->used.resize((new_pages + 63) / 64, 0);
+        return *it;
+    }
+
+    Segment merged;
+    merged.base = new_base;
+    merged.data.assign(new_end - new_base, m_page_fill);
+    merged.used.assign((new_pages + 63) / 64, 0);
+    for(auto seg = it; seg != last; ++seg)
+    {
+        const size_t offset = seg->base - new_base;
+        memcpy(merged.data.data() + offset, seg->data.data(), seg->data.size());
+
+        const size_t first_page = offset / m_page_size;
+        const size_t count = seg->data.size() / m_page_size;
+        for(size_t i = 0; i < count; i++)
+        {
+            if ( seg->is_used(i) ) merged.used[(first_page + i) / 64] |= uint64_t(1) << ((first_page + i) % 64);
+        }
+    }
+
+    *it = std::move(merged);
+    segments.erase(std::next(it), last);
+    return *it;
+}
+
+void FirmwareImage::write(uint32_t addr, const uint8_t *data, size_t size)
+{
+    if ( size == 0 ) return;
+
+    const uint64_t mask = m_page_size - 1;
+    const uint64_t start = addr & ~mask;
+    const uint64_t stop = (uint64_t(addr) + size + mask) & ~mask;
+
+    Segment &seg = reserve(start, stop);
+    memcpy(seg.data.data() + (addr - seg.base), data, size);
+
+    const size_t first_page = (start - seg.base) / m_page_size;
+    const size_t count = (stop - start) / m_page_size;
+    for(size_t i = 0; i < count; i++)
+    {
+        mark_used(seg, first_page + i);
+    }
+}
+
+void FirmwareImage::erase(uint32_t page_addr)
+{
+    for(Segment &seg : segments)
+    {
+        if ( page_addr < seg.base || page_addr >= seg.end() ) continue;
+
+        const size_t page = (page_addr - seg.base) / m_page_size;
+        uint64_t &word = seg.used[page / 64];
+        const uint64_t mask = uint64_t(1) << (page % 64);
+        if ( word & mask )
+        {
+            word &= ~mask;
+            m_used_pages--;
+
+            // повторная запись в страницу должна начинаться с чистой
+            // страницы, как с новой
+            memset(seg.data.data() + page * m_page_size, m_page_fill, m_page_size);
+        }
+        return;
+    }
+}
+
+uint32_t FirmwareImage::getDataSize() const
+{
+    return m_used_pages * m_page_size;
+}
+
+std::vector<uint8_t> FirmwareImage::getDataDump() const
 {
     std::vector<uint8_t> data (getDataSize());
     uint32_t addr = 0;
-    for(const auto &it : *this)
+    for(const auto &[page_addr, page] : *this)
     {
-        const auto page_size = it.second.page_size();
-        memcpy(data.data() + addr, it.second.data.data(), page_size);
-        addr += page_size;
+        memcpy(data.data() + addr, page.data.data(), page.data.size());
+        addr += page.data.size();
     }
 
     return data;
 }
 
-void FirmwareData::saveToTextStream(QTextStream &ts) const
+/**
+ * Записать одну запись Intel HEX: ':', длина, адрес, тип, данные,
+ * контрольная сумма и перевод строки
+ */
+static char* put_hex_record(char *p, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t size)
 {
-    const auto data = getDataDump();
-    const unsigned lineCount = data.size() / 16;
+    const uint8_t head[4] = { size, uint8_t(addr >> 8), uint8_t(addr), type };
+    uint8_t sum = size + head[1] + head[2] + type;
+    for(unsigned i = 0; i < size; i++) sum += data[i];
+    const uint8_t cs = 0 - sum;
 
-    for(unsigned iLine = 0; iLine < lineCount; iLine++)
+    *p++ = ':';
+    p = nano::encode_hex(head, sizeof(head), p);
+    p = nano::encode_hex(data, size, p);
+    p = nano::encode_hex(&cs, 1, p);
+    *p++ = '\n';
+    return p;
+}
+
+std::string FirmwareImage::toIntelHex(bool skip_blank) const
+{
+    constexpr uint32_t LINE_SIZE = 16;
+    constexpr size_t DATA_RECORD = 1 + (5 + LINE_SIZE) * 2 + 1;
+    constexpr size_t SHORT_RECORD = 1 + (5 + 2) * 2 + 1;
+
+    // каждая непрерывная группа страниц дает не больше одной неполной
+    // строки, перед каждой строкой может понадобиться запись 04
+    const size_t max_lines = getDataSize() / LINE_SIZE + m_used_pages + 1;
+    std::string text(max_lines * (DATA_RECORD + SHORT_RECORD) + SHORT_RECORD, '\0');
+    char *p = text.data();
+
+    uint32_t upper = 0;
+    auto put_run = [&] (uint32_t addr, const uint8_t *data, size_t size)
     {
-        const uint32_t line_addr = iLine * 16;
-        char buf[100];
-        char *rest = buf + sprintf(buf, ":10%04X00", line_addr);
-        uint8_t cs = 0 - 0x10 - uint8_t(line_addr) - uint8_t(line_addr >> 8);
-        for(unsigned iByte = 0; iByte < 16; iByte++)
+        while ( size > 0 )
         {
-            const uint8_t byte = data[line_addr + iByte];
-            cs -= byte;
-            rest += sprintf(rest, "%02X", byte);
+            // строка не пересекает границу 64 КБ
+            const uint32_t chunk = std::min<size_t>({ LINE_SIZE, size, 0x10000 - (addr & 0xFFFF) });
+            if ( !skip_blank || !is_blank(data, chunk) )
+            {
+                if ( (addr >> 16) != upper )
+                {
+                    upper = addr >> 16;
+                    const uint8_t ela[2] = { uint8_t(upper >> 8), uint8_t(upper) };
+                    p = put_hex_record(p, 0x04, 0, ela, sizeof(ela));
+                }
+                p = put_hex_record(p, 0x00, addr & 0xFFFF, data, chunk);
+            }
+            addr += chunk;
+            data += chunk;
+            size -= chunk;
         }
-        sprintf(rest, "%02X\n", cs);
-        ts << buf;
-    }
+    };
 
-    const unsigned restCount = data.size() - lineCount * 16;
-    if ( restCount > 0 )
+    for(const Segment &seg : segments)
     {
-        const uint32_t line_addr = lineCount * 16;
-        char buf[100];
-        char *rest = buf + sprintf(buf, ":%02X%04X00", restCount, line_addr);
-        uint8_t cs = 0 - 0x10 - uint8_t(restCount) - uint8_t(line_addr) - uint8_t(line_addr >> 8);
-        for(unsigned iByte = 0; iByte < restCount; iByte++)
+        // соседние занятые страницы сегмента пишутся одним куском
+        const size_t count = seg.data.size() / m_page_size;
+        size_t first = 0;
+        for(size_t page = 0; page <= count; page++)
         {
-            const uint8_t byte = data[line_addr + iByte];
-            cs -= byte;
-            rest += sprintf(rest, "%02X", byte);
+            if ( page < count && seg.is_used(page) ) continue;
+            if ( page > first )
+            {
+                const size_t offset = first * m_page_size;
+                put_run(seg.base + offset, seg.data.data() + offset, (page - first) * m_page_size);
+            }
+            first = page + 1;
         }
-        sprintf(rest, "%02X\n", cs);
-        ts << buf;
     }
 
-    ts << ":00000001FF\n";
+    p = put_hex_record(p, 0x01, 0, nullptr, 0);
+    text.resize(p - text.data());
+    return text;
+}
 
+void FirmwareImage::saveToTextStream(QTextStream &ts, bool skip_blank) const
+{
+    const std::string text = toIntelHex(skip_blank);
+    ts << QString::fromLatin1(text.data(), text.size());
 }
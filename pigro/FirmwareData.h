@@ -3,9 +3,12 @@
 
 #include <QTextStream>
 #include <cstdint>
-#include <map>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <functional>
 
 #include <nano/math.h>
 #include <nano/exception.h>
@@ -13,80 +16,294 @@
 #include "IntelHEX.h"
 
 
+/**
+ * Проверить, что блок целиком заполнен байтом fill
+ *
+ * Сравнение идет словами по 8 байт с накоплением разницы без ветвлений,
+ * такой цикл компилятор векторизует
+ */
+inline bool is_blank(const uint8_t *data, size_t size, uint8_t fill = 0xFF)
+{
+    const uint64_t pattern = 0x0101010101010101ull * fill;
+    uint64_t diff = 0;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        diff |= word ^ pattern;
+    }
+    for(; i < size; i++) diff |= data[i] ^ fill;
+    return diff == 0;
+}
+
+/**
+ * Непрерывный блок байт без владения (аналог std::span)
+ */
+class ByteSpan
+{
+public:
+
+    ByteSpan() = default;
+    ByteSpan(const uint8_t *ptr, size_t len): ptr(ptr), len(len) { }
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + len; }
+
+    uint8_t operator [] (size_t i) const { return ptr[i]; }
+
+private:
+
+    const uint8_t *ptr { nullptr };
+    size_t len { 0 };
+};
+
+/**
+ * Страница прошивки - вид на данные внутри FirmwareImage
+ *
+ * Действителен, пока образ не изменяется
+ */
 struct PageData
 {
     uint32_t addr;
-    std::vector<uint8_t> data;
+    ByteSpan data;
 
     uint32_t page_size() const { return data.size(); }
-    void resize(uint32_t newSize) { data.resize(newSize); }
+
+    /**
+     * Страница целиком стертая (0xFF), ее не нужно программировать
+     */
+    bool blank() const { return is_blank(data.data(), data.size()); }
 };
 
-class FirmwareData: public std::map<uint32_t, PageData>
+/**
+ * Образ прошивки
+ *
+ * Данные хранятся сегментами - одним непрерывным буфером на каждый
+ * занятый диапазон адресов, какие страницы заняты - в битовой карте
+ * сегмента. Близкие сегменты (с зазором до SEGMENT_GAP) сливаются,
+ * зазор заполняется page_fill.
+ *
+ * Обход идет по занятым страницам в порядке адресов, элемент -
+ * пара (адрес страницы, PageData), как у std::map<uint32_t, PageData>
+ */
+class FirmwareImage
 {
+    friend class FirmwareCache;
+
+private:
+
+    struct Segment
+    {
+        /**
+         * Адрес начала, выровнен на страницу
+         */
+        uint32_t base;
+
+        /**
+         * Данные, размер кратен размеру страницы
+         */
+        std::vector<uint8_t> data;
+
+        /**
+         * Битовая карта занятых страниц
+         */
+        std::vector<uint64_t> used;
+
+        uint64_t end() const { return uint64_t(base) + data.size(); }
+
+        bool is_used(size_t page) const { return (used[page / 64] >> (page % 64)) & 1; }
+    };
+
 public:
 
-    static FirmwareData LoadFromHex(const IntelHEX &hex, const uint32_t page_size = 1024, const uint8_t page_fill = 0xFF)
+    /**
+     * Максимальный зазор между сегментами, при котором они сливаются
+     */
+    static constexpr uint32_t SEGMENT_GAP = 0x10000;
+
+    using value_type = std::pair<uint32_t, PageData>;
+
+    class const_iterator
     {
-        if ( !nano::is_power_of_two(page_size) ) throw nano::exception("FirmwareData: page_size is not poewr of two: " + std::to_string(page_size));
+    public:
 
-        const uint32_t byte_mask = page_size - 1;
-        const uint32_t page_mask = ~byte_mask;
+        const_iterator(const FirmwareImage *image, size_t segment, size_t page):
+            image(image), segment(segment), page(page)
+        {
+            skip();
+        }
 
-        FirmwareData pages;
-        uint32_t LoadAddress = 0;
-        for(const auto &row : hex.rows)
+        value_type operator * () const
+        {
+            const Segment &seg = image->segments[segment];
+            const size_t offset = page * image->m_page_size;
+            const uint32_t addr = seg.base + offset;
+            return { addr, PageData { addr, ByteSpan(seg.data.data() + offset, image->m_page_size) } };
+        }
+
+        const_iterator& operator ++ ()
+        {
+            page++;
+            skip();
+            return *this;
+        }
+
+        bool operator == (const const_iterator &other) const { return segment == other.segment && page == other.page; }
+        bool operator != (const const_iterator &other) const { return !(*this == other); }
+
+    private:
+
+        const FirmwareImage *image;
+        size_t segment;
+        size_t page;
+
+        /**
+         * Перейти к ближайшей занятой странице, пустые слова карты
+         * пропускаются целиком
+         */
+        void skip();
+    };
+
+    explicit FirmwareImage(uint32_t page_size = 1024, uint8_t page_fill = 0xFF):
+        m_page_size(page_size), m_page_fill(page_fill)
+    {
+        if ( !nano::is_power_of_two(page_size) ) throw nano::exception("FirmwareImage: page_size is not power of two: " + std::to_string(page_size));
+    }
+
+    uint32_t page_size() const { return m_page_size; }
+    uint8_t page_fill() const { return m_page_fill; }
+
+    /**
+     * Число занятых страниц
+     */
+    size_t size() const { return m_used_pages; }
+    bool empty() const { return m_used_pages == 0; }
+
+    const_iterator begin() const { return const_iterator(this, 0, 0); }
+    const_iterator end() const { return const_iterator(this, segments.size(), 0); }
+
+    /**
+     * Записать блок данных
+     *
+     * Затронутые страницы помечаются занятыми, новые страницы
+     * заполняются page_fill. Блок копируется одним memcpy
+     */
+    void write(uint32_t addr, const uint8_t *data, size_t size);
+
+    /**
+     * Освободить страницу, ее данные заполняются page_fill
+     */
+    void erase(uint32_t page_addr);
+
+    /**
+     * Разбор записей IntelHEX в страницы
+     */
+    class HexSink
+    {
+    public:
+
+        explicit HexSink(FirmwareImage &pages): pages(pages)
+        {
+        }
+
+        void operator () (const IntelHEX::row_t &row)
         {
             if ( row.type() == 0x04 )
             {
                 if ( row.length() != 2 ) throw nano::exception("FirmwareData: wrong LBA record (IntelHEX)");
                 LoadAddress = (row.data()[0] << 24) | (row.data()[1] << 16);
-                continue;
+                return;
             }
 
             if ( row.type() == 0x02 )
             {
-                throw nano::exception("FirmwareData: unsupported Extended Segment Address Record (IntelHEX)");
+                if ( row.length() != 2 ) throw nano::exception("FirmwareData: wrong Extended Segment Address Record (IntelHEX)");
+                LoadAddress = ((row.data()[0] << 8) | row.data()[1]) << 4;
+                return;
             }
 
+            // 0x03/0x05 - стартовый адрес, для прошивки не нужен
+
             if ( row.type() == 0 )
             {
-                const uint8_t *row_data = row.data();
-                const uint32_t row_addr = LoadAddress + row.addr();
-                const uint32_t row_size = row.length();
-
-                for(uint32_t i = 0; i < row_size; i++)
-                {
-                    const uint32_t byte_addr = row_addr + i;
-                    const uint32_t page_addr = byte_addr & page_mask;
-                    const uint32_t byte_offset = byte_addr & byte_mask;
-                    PageData &page = pages[page_addr];
-                    if ( page.data.size() == 0 )
-                    {
-                        page.addr = page_addr;
-                        page.data.resize(page_size);
-                        std::fill(page.data.begin(), page.data.end(), page_fill);
-                    }
-                    page.data[byte_offset] = row_data[i];
-                }
+                pages.write(LoadAddress + row.addr(), row.data(), row.length());
             }
         }
 
-        return pages;
+    private:
 
-    }
+        FirmwareImage &pages;
+        uint32_t LoadAddress = 0;
+    };
 
-    static FirmwareData LoadFromFile(const std::string &path, uint32_t page_size = 1024, const uint8_t page_fill = 0xFF)
+    static FirmwareImage LoadFromHex(const IntelHEX &hex, const uint32_t page_size = 1024, const uint8_t page_fill = 0xFF)
     {
-        if ( !nano::is_power_of_two(page_size) ) throw nano::exception("FirmwareData: page_size is not power of two");
-        return LoadFromHex(IntelHEX(path), page_size, page_fill);
+        FirmwareImage pages(page_size, page_fill);
+        HexSink sink(pages);
+        for(const auto &row : hex.rows)
+        {
+            sink(row);
+        }
+
+        return pages;
+
     }
 
+    /**
+     * Загрузить прошивку из файла (Intel HEX, S-record, ELF или двоичный)
+     *
+     * Формат определяется автоматически, см. FirmwareFile
+     *
+     * @param base_address адрес загрузки двоичного файла
+     * @param cache брать разобранный образ из FirmwareCache
+     */
+    static FirmwareImage LoadFromFile(const std::string &path, uint32_t page_size = 1024, const uint8_t page_fill = 0xFF, uint32_t base_address = 0, bool cache = false);
+
     uint32_t getDataSize() const;
     std::vector<uint8_t> getDataDump() const;
 
-    void saveToTextStream(QTextStream &ts) const;
+    /**
+     * Выгрузить образ в Intel HEX
+     *
+     * Страницы пишутся по своим адресам, строки по 16 байт не пересекают
+     * границу 64 КБ, старшая часть адреса задается записями 04.
+     * Текст кодируется по таблице в один заранее выделенный буфер
+     *
+     * @param skip_blank пропускать строки, целиком заполненные 0xFF
+     */
+    std::string toIntelHex(bool skip_blank = false) const;
+
+    void saveToTextStream(QTextStream &ts, bool skip_blank = false) const;
+
+private:
+
+    uint32_t m_page_size;
+    uint8_t m_page_fill;
+    size_t m_used_pages { 0 };
+
+    /**
+     * Сегменты по возрастанию адресов, зазор между соседними
+     * больше SEGMENT_GAP
+     */
+    std::vector<Segment> segments;
+
+    /**
+     * Найти или создать сегмент, покрывающий [start, stop)
+     */
+    Segment& reserve(uint64_t start, uint64_t stop);
+
+    void mark_used(Segment &seg, size_t page);
 
 };
 
+/**
+ * Старое имя образа прошивки
+ */
+using FirmwareData = FirmwareImage;
+
 #endif // FIRMWAREDATA_H
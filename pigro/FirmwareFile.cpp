@@ -0,0 +1,183 @@
+#include "FirmwareFile.h"
+#include "FirmwareData.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <nano/exception.h>
+#include <nano/string.h>
+
+FirmwareFile::Format FirmwareFile::detect(const QString &path, std::string_view content)
+{
+    const QString suffix = QFileInfo(path).suffix().toLower();
+    if ( suffix == "hex" || suffix == "ihx" || suffix == "eep" ) return Format::IntelHex;
+    if ( suffix == "srec" || suffix == "s19" || suffix == "s28" || suffix == "s37" || suffix == "mot" ) return Format::SRecord;
+    if ( suffix == "elf" || suffix == "axf" ) return Format::Elf;
+    if ( suffix == "bin" ) return Format::Binary;
+
+    if ( content.size() >= 4 && content.substr(0, 4) == std::string_view("\x7F" "ELF", 4) ) return Format::Elf;
+
+    const size_t first = content.find_first_not_of(" \t\r\n");
+    if ( first != std::string_view::npos )
+    {
+        const std::string_view text = content.substr(first);
+        if ( text.size() >= 11 && text[0] == ':' ) return Format::IntelHex;
+        if ( text.size() >= 10 && text[0] == 'S' && text[1] >= '0' && text[1] <= '9' ) return Format::SRecord;
+    }
+
+    return Format::Binary;
+}
+
+std::string_view FirmwareFile::readFile(QFile &file, QByteArray &buffer)
+{
+    const qint64 size = file.size();
+    if ( const uchar *data = size > 0 ? file.map(0, size) : nullptr )
+    {
+        return std::string_view(reinterpret_cast<const char*>(data), size);
+    }
+
+    buffer = file.readAll();
+    return std::string_view(buffer.constData(), buffer.size());
+}
+
+void FirmwareFile::load(const QString &path, FirmwareImage &image, uint32_t base_address, Format format)
+{
+    QFile file(path);
+    if ( !file.open(QIODevice::ReadOnly) )
+    {
+        throw nano::exception(QStringLiteral("fail to open file: ").append(path));
+    }
+
+    QByteArray buffer;
+    load(path, readFile(file, buffer), image, base_address, format);
+}
+
+void FirmwareFile::load(const QString &path, std::string_view content, FirmwareImage &image, uint32_t base_address, Format format)
+{
+    if ( format == Format::Auto ) format = detect(path, content);
+
+    switch ( format )
+    {
+    case Format::IntelHex: return loadIntelHex(content, image);
+    case Format::SRecord: return loadSRecord(content, image);
+    case Format::Elf: return loadElf(content, image);
+    case Format::Binary: return loadBinary(content, image, base_address);
+    case Format::Auto: break;
+    }
+
+    throw nano::exception("unknown firmware format");
+}
+
+void FirmwareFile::loadIntelHex(std::string_view text, FirmwareImage &image)
+{
+    FirmwareImage::HexSink sink(image);
+    IntelHEX::parse(text, std::ref(sink));
+}
+
+void FirmwareFile::loadSRecord(std::string_view text, FirmwareImage &image)
+{
+    uint8_t bytes[256];
+    const char *p = text.data();
+    const char *end = p + text.size();
+
+    while ( true )
+    {
+        while ( p < end && (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') ) p++;
+        if ( p == end ) return;
+
+        if ( end - p < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9' )
+        {
+            throw nano::exception("wrong srec-file: line doesn't start from 'S'");
+        }
+
+        const char type = p[1];
+        if ( !nano::decode_hex(p + 2, bytes, 1) ) throw nano::exception("wrong hex digit");
+
+        // count - число байт после него: адрес, данные, контрольная сумма
+        const uint8_t count = bytes[0];
+        if ( end - p < 4 + count * 2 ) throw nano::exception("wrong srec-file: line too short");
+        if ( !nano::decode_hex(p + 4, bytes + 1, count) ) throw nano::exception("wrong hex digit");
+        p += 4 + count * 2;
+
+        uint8_t sum = 0;
+        for(int i = 0; i <= count; i++) sum += bytes[i];
+        if ( sum != 0xFF ) throw nano::exception("wrong srec-file: wrong checksum");
+
+        int addr_len = 0;
+        if ( type == '1' ) addr_len = 2;
+        else if ( type == '2' ) addr_len = 3;
+        else if ( type == '3' ) addr_len = 4;
+        else if ( type == '7' || type == '8' || type == '9' ) return;
+        else continue; // S0 - заголовок, S5/S6 - число записей
+
+        if ( count < addr_len + 1 ) throw nano::exception("wrong srec-file: record too short");
+
+        uint32_t addr = 0;
+        for(int i = 0; i < addr_len; i++) addr = (addr << 8) | bytes[1 + i];
+
+        image.write(addr, bytes + 1 + addr_len, count - addr_len - 1);
+    }
+}
+
+static uint16_t read16(const char *p)
+{
+    return uint8_t(p[0]) | (uint8_t(p[1]) << 8);
+}
+
+static uint32_t read32(const char *p)
+{
+    return read16(p) | (uint32_t(read16(p + 2)) << 16);
+}
+
+void FirmwareFile::loadElf(std::string_view data, FirmwareImage &image)
+{
+    constexpr uint8_t ELFCLASS32 = 1;
+    constexpr uint8_t ELFDATA2LSB = 1;
+    constexpr uint16_t EM_AVR = 83;
+    constexpr uint32_t PT_LOAD = 1;
+    constexpr size_t PHDR_SIZE = 32;
+
+    const char *elf = data.data();
+    if ( data.size() < 52 || data.substr(0, 4) != std::string_view("\x7F" "ELF", 4) )
+    {
+        throw nano::exception("wrong elf-file: bad header");
+    }
+    if ( uint8_t(elf[4]) != ELFCLASS32 || uint8_t(elf[5]) != ELFDATA2LSB )
+    {
+        throw nano::exception("wrong elf-file: only 32-bit little-endian ELF supported");
+    }
+
+    const uint16_t machine = read16(elf + 18);
+    const uint32_t phoff = read32(elf + 28);
+    const uint16_t phentsize = read16(elf + 42);
+    const uint16_t phnum = read16(elf + 44);
+    if ( phentsize < PHDR_SIZE || phoff + uint64_t(phentsize) * phnum > data.size() )
+    {
+        throw nano::exception("wrong elf-file: bad program headers");
+    }
+
+    for(uint16_t i = 0; i < phnum; i++)
+    {
+        const char *ph = elf + phoff + i * phentsize;
+        if ( read32(ph) != PT_LOAD ) continue;
+
+        const uint32_t offset = read32(ph + 4);
+        const uint32_t paddr = read32(ph + 12);
+        const uint32_t filesz = read32(ph + 16);
+        if ( filesz == 0 ) continue;
+
+        // у avr-gcc SRAM и EEPROM вынесены в адреса 0x800000 и 0x810000,
+        // во флеш идет только то, что ниже
+        if ( machine == EM_AVR && paddr >= 0x800000 ) continue;
+
+        if ( uint64_t(offset) + filesz > data.size() ) throw nano::exception("wrong elf-file: segment out of file");
+
+        // грузим по физическому адресу (LMA), там лежат и
+        // инициализаторы .data
+        image.write(paddr, reinterpret_cast<const uint8_t*>(elf + offset), filesz);
+    }
+}
+
+void FirmwareFile::loadBinary(std::string_view data, FirmwareImage &image, uint32_t base_address)
+{
+    image.write(base_address, reinterpret_cast<const uint8_t*>(data.data()), data.size());
+}
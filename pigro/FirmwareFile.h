@@ -0,0 +1,67 @@
+#ifndef PIGRO_FIRMWARE_FILE_H
+#define PIGRO_FIRMWARE_FILE_H
+
+#include <QString>
+#include <QByteArray>
+#include <string_view>
+#include <cstdint>
+
+class QFile;
+class FirmwareImage;
+
+/**
+ * Загрузка файлов прошивки разных форматов
+ *
+ * Файл отображается в память, все форматы пишут данные прямо
+ * в FirmwareImage
+ */
+class FirmwareFile
+{
+public:
+
+    enum class Format
+    {
+        Auto,
+        IntelHex,
+        SRecord,
+        Elf,
+        Binary
+    };
+
+    /**
+     * Определить формат по расширению, а если оно незнакомое -
+     * по содержимому файла
+     */
+    static Format detect(const QString &path, std::string_view content);
+
+    /**
+     * Загрузить файл прошивки в образ
+     *
+     * @param base_address адрес загрузки для двоичного файла
+     */
+    static void load(const QString &path, FirmwareImage &image, uint32_t base_address = 0, Format format = Format::Auto);
+
+    /**
+     * Загрузить прошивку из уже прочитанного содержимого файла
+     *
+     * @param path имя файла, нужно только для определения формата
+     */
+    static void load(const QString &path, std::string_view content, FirmwareImage &image, uint32_t base_address = 0, Format format = Format::Auto);
+
+    /**
+     * Получить содержимое открытого файла
+     *
+     * Файл отображается в память, если не удалось (не обычный файл) -
+     * читается целиком в buffer. Результат действителен, пока открыт
+     * файл и жив buffer
+     */
+    static std::string_view readFile(QFile &file, QByteArray &buffer);
+
+    static void loadIntelHex(std::string_view text, FirmwareImage &image);
+    static void loadSRecord(std::string_view text, FirmwareImage &image);
+    static void loadElf(std::string_view data, FirmwareImage &image);
+    static void loadBinary(std::string_view data, FirmwareImage &image, uint32_t base_address);
+
+};
+
+#endif // PIGRO_FIRMWARE_FILE_H
@@ -17,6 +17,12 @@ void FirmwareInfo::loadFromFile(const QString &path)
         verbose = false;
     }
 
+    if ( const std::string rate = projectInfo.value("baudrate"); !rate.empty() )
+    {
+        baudrate = nano::parse_int(rate);
+        if ( baudrate == 0 ) throw nano::exception("wrong baudrate (pigro.ini): " + rate);
+    }
+
     device = QString::fromStdString(projectInfo.value("device"));
     if ( device.isEmpty() )
     {
@@ -32,7 +38,8 @@ void FirmwareInfo::loadFromFile(const QString &path)
         throw nano::exception("device not found: " + device);
     }
 
-    hexFileName = QString::fromStdString(projectInfo.value("hex"));
+    // файл прошивки: Intel HEX, S-record, ELF или двоичный (firmware - синоним hex)
+    hexFileName = QString::fromStdString(projectInfo.value("hex", projectInfo.value("firmware")));
     if ( hexFileName.isEmpty() )
     {
         throw nano::exception("specify hex file name (pigro.ini)");
@@ -40,6 +47,12 @@ void FirmwareInfo::loadFromFile(const QString &path)
 
     hexFilePath = QFileInfo(path).dir().filePath(hexFileName);
 
+    eepromFileName = QString::fromStdString(projectInfo.value("eeprom"));
+    if ( !eepromFileName.isEmpty() )
+    {
+        eepromFilePath = QFileInfo(path).dir().filePath(eepromFileName);
+    }
+
     device_type = QString::fromStdString(m_chip_info.value("type", "avr"));
     if ( verbose )
     {
@@ -47,5 +60,6 @@ void FirmwareInfo::loadFromFile(const QString &path)
         std::cout << "device name: " << m_chip_info.value("name") << "\n";
         //std::cout << "flash_size: " << ((m_chip_info.flash_size()+1023) / 1024) << "k\n";
         std::cout << "hex_file: " << hexFilePath.toStdString() << "\n";
+        if ( !eepromFilePath.isEmpty() ) std::cout << "eeprom_file: " << eepromFilePath.toStdString() << "\n";
     }
 }
@@ -11,9 +11,21 @@ public:
 
     bool verbose { false };
 
+    /**
+     * Скорость линии с адаптером (параметр baudrate в pigro.ini)
+     */
+    uint32_t baudrate { 115200 };
+
     QString device { };
     QString hexFileName { };
     QString hexFilePath { };
+
+    /**
+     * Образ EEPROM (необязательный параметр eeprom в pigro.ini)
+     */
+    QString eepromFileName { };
+    QString eepromFilePath { };
+
     QString device_type { };
 
     nano::options projectInfo { };
@@ -1,58 +1,48 @@
 #include "IntelHEX.h"
 
 #include <QFile>
-#include <QTextStream>
+#include <nano/exception.h>
 #include <nano/string.h>
 
-/**
- * Прочитать байт
- */
-static uint8_t parse_hex_byte(const char *line, int i)
+static bool is_space(char ch)
 {
-    int offset = i * 2 + 1;
-    return nano::parse_hex_digit(line[offset]) * 0x10 + nano::parse_hex_digit(line[offset+1]);
+    return ch == '\r' || ch == '\n' || ch == ' ' || ch == '\t';
 }
 
-void IntelHEX::open(const QString &path)
+void IntelHEX::parse(std::string_view text, const record_handler_t &handler)
 {
-    rows.clear();
+    row_t row;
+    const char *p = text.data();
+    const char *end = p + text.size();
 
-    QFile file(path);
-    if ( !file.open(QIODevice::ReadOnly | QIODevice::Text) )
+    while ( true )
     {
-        throw nano::exception(QStringLiteral("fail to open file: ").append(path));
-    }
-    QTextStream f(&file);
+        while ( p < end && is_space(*p) ) p++;
+        if ( p == end ) break;
 
-    while ( !f.atEnd() )
-    {
-        row_t row {};
-        const std::string line = f.readLine().toStdString();
-        if ( line.length() < 11 ) throw nano::exception("wrong hex-file: line length < 11");
-        if ( line[0] != ':' )
+        if ( *p != ':' )
         {
             throw nano::exception("wrong hex-file: line doen't start from ':'");
         }
 
-        uint8_t len = parse_hex_byte(line.data(), 0);
-        int bytelen = len + 5;
-        size_t charlen = bytelen * 2 + 1;
-        if ( line.length() < charlen ) throw nano::exception("wrong hex-file: line too short");
+        if ( end - p < 11 ) throw nano::exception("wrong hex-file: line length < 11");
+        if ( !nano::decode_hex(p + 1, row.bytes, 1) ) throw nano::exception("wrong hex digit");
 
-        for(int i = 0; i < bytelen; i++)
-        {
-            row.bytes[i] = parse_hex_byte(line.data(), i);
-        }
+        const int bytelen = row.length() + 5;
+        const ptrdiff_t charlen = bytelen * 2 + 1;
+        if ( end - p < charlen ) throw nano::exception("wrong hex-file: line too short");
+
+        if ( !nano::decode_hex(p + 3, row.bytes + 1, bytelen - 1) ) throw nano::exception("wrong hex digit");
+        p += charlen;
 
         uint8_t sum = 0;
-        for(int i = 0; i < (bytelen-1); i++)
+        for(int i = 0; i < bytelen; i++)
         {
-            sum -= row.bytes[i];
+            sum += row.bytes[i];
         }
+        if ( sum != 0 ) throw nano::exception("wrong hex-file: wrong checksum");
 
-        if ( row.checksum() != sum ) throw nano::exception("wrong hex-file: wrong checksum");
-
-        rows.push_back(std::move(row));
+        handler(row);
 
         if ( row.type() == 1 )
         {
@@ -62,3 +52,33 @@ void IntelHEX::open(const QString &path)
 
     throw nano::exception("wrong hex-file: unexpected end of file");
 }
+
+void IntelHEX::parseFile(const QString &path, const record_handler_t &handler)
+{
+    QFile file(path);
+    if ( !file.open(QIODevice::ReadOnly) )
+    {
+        throw nano::exception(QStringLiteral("fail to open file: ").append(path));
+    }
+
+    const qint64 size = file.size();
+    if ( size == 0 ) throw nano::exception("wrong hex-file: unexpected end of file");
+
+    // если отобразить не удалось (не обычный файл), читаем целиком
+    if ( const uchar *data = file.map(0, size) )
+    {
+        parse(std::string_view(reinterpret_cast<const char*>(data), size), handler);
+        return;
+    }
+
+    const QByteArray data = file.readAll();
+    parse(std::string_view(data.constData(), data.size()), handler);
+}
+
+void IntelHEX::open(const QString &path)
+{
+    rows.clear();
+    parseFile(path, [this] (const row_t &row) {
+        rows.push_back(row);
+    });
+}
@@ -6,6 +6,7 @@
 #include <list>
 #include <array>
 #include <vector>
+#include <functional>
 #include <string_view>
 
 /**
@@ -26,6 +27,14 @@ public:
         const uint8_t* data() const { return &bytes[4]; }
     };
 
+    /**
+     * Обработчик записей потокового разбора
+     *
+     * Запись передается в виде row_t во временном буфере, он
+     * действителен только на время вызова
+     */
+    using record_handler_t = std::function<void(const row_t &row)>;
+
     std::list<row_t> rows;
 
     IntelHEX() = default;
@@ -47,8 +56,27 @@ public:
         open(path);
     }
 
+    /**
+     * Прочитать файл целиком в rows
+     *
+     * Обертка над parseFile() для старого кода, новому коду лучше
+     * разбирать файл потоком
+     */
     void open(const QString &path);
 
+    /**
+     * Разобрать HEX-файл потоком
+     *
+     * Файл отображается в память, записи проверяются по контрольной
+     * сумме и сразу передаются в handler, без промежуточного списка
+     */
+    static void parseFile(const QString &path, const record_handler_t &handler);
+
+    /**
+     * Разобрать HEX-данные из памяти
+     */
+    static void parse(std::string_view text, const record_handler_t &handler);
+
 };
 
 #endif // INTELHEX_H
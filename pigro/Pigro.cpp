@@ -127,7 +127,7 @@ void Pigro::isp_check_firmware(const QString tty, const QString project_path)
         {
             emit chipInfo(driver->getIspChipInfo());
 
-            const auto pages = FirmwareData::LoadFromFile(firmwareInfo.hexFilePath.toStdString(), driver->page_size(), driver->page_fill());
+            const auto pages = FirmwareData::LoadFromFile(firmwareInfo.hexFilePath.toStdString(), driver->page_size(), driver->page_fill(), driver->base_address(), driver->firmware_cache());
             emit reportMessage(QStringLiteral("page usages: %1 / %2").arg(pages.size()).arg(driver->page_count()));
             driver->isp_check_firmware(pages);
         }
@@ -162,7 +162,7 @@ void Pigro::isp_write_firmware(const QString tty, const QString project_path)
         {
             emit chipInfo(driver->getIspChipInfo());
 
-            const auto pages = FirmwareData::LoadFromFile(firmwareInfo.hexFilePath.toStdString(), driver->page_size(), driver->page_fill());
+            const auto pages = FirmwareData::LoadFromFile(firmwareInfo.hexFilePath.toStdString(), driver->page_size(), driver->page_fill(), driver->base_address(), driver->firmware_cache());
             emit reportMessage(QStringLiteral("page usages: %1 / %2").arg(pages.size()).arg(driver->page_count()));
             driver->isp_write_firmware(pages);
         }
@@ -41,6 +41,8 @@ protected:
 
     PigroDriver* lookupDriver(const FirmwareInfo &firmwareInfo)
     {
+        m_link->setBaudRate(firmwareInfo.baudrate);
+
         const auto driver = lookupDriver(firmwareInfo.device_type);
         driver->setFirmwareInfo(firmwareInfo);
         driver->parse_device_info(firmwareInfo.m_chip_info);
@@ -132,7 +134,7 @@ public:
 
     FirmwareData readHEX()
     {
-        auto pages = FirmwareData::LoadFromFile(driver->firmwareInfo().hexFilePath.toStdString(), driver->page_size(), driver->page_fill());
+        auto pages = FirmwareData::LoadFromFile(driver->firmwareInfo().hexFilePath.toStdString(), driver->page_size(), driver->page_fill(), driver->base_address(), driver->firmware_cache());
         printf("page usages: %ld / %d\n", pages.size(), driver->page_count());
         return pages;
     }
@@ -0,0 +1,176 @@
+#include "PigroBatch.h"
+#include <nano/exception.h>
+#include <QThread>
+
+constexpr uint8_t CMD_BATCH = 18;
+
+/**
+ * Подкоманда паузы, data[0] - число периодов таймера адаптера
+ */
+constexpr uint8_t BATCH_PAUSE = 0;
+
+/**
+ * Период таймера адаптера в микросекундах
+ */
+constexpr unsigned BATCH_TICK_US = 272;
+
+void PigroBatch::add(const packet_t &pkt, reply_handler_t handler)
+{
+    // ответ придет в любом случае, без обработчика он бы сдвинул
+    // разбор ответов всех следующих команд
+    if ( !handler && PigroLink::commandHasReply(pkt.cmd) )
+    {
+        handler = [] (const bulk_t &) { };
+    }
+
+    m_items.push_back({pkt, std::move(handler)});
+}
+
+void PigroBatch::pause(unsigned msecs)
+{
+    unsigned ticks = (msecs * 1000 + BATCH_TICK_US - 1) / BATCH_TICK_US;
+    while ( ticks > 0 )
+    {
+        packet_t pkt;
+        pkt.cmd = BATCH_PAUSE;
+        pkt.len = 1;
+        pkt.data[0] = ticks > 0xFF ? 0xFF : ticks;
+        ticks -= pkt.data[0];
+        add(pkt);
+    }
+}
+
+void PigroBatch::isp_reset(bool value)
+{
+    packet_t pkt;
+    pkt.cmd = 2;
+    pkt.len = 1;
+    pkt.data[0] = value ? 1 : 0;
+    add(pkt);
+}
+
+void PigroBatch::isp_io(uint32_t cmd, std::function<void(uint32_t result)> handler)
+{
+    packet_t pkt;
+    pkt.cmd = 3;
+    pkt.len = 4;
+    for(int i = 0; i < 4; i++)
+    {
+        pkt.data[i] = cmd >> 24;
+        cmd <<= 8;
+    }
+
+    add(pkt, [handler] (const bulk_t &reply) {
+        if ( reply.cmd != 3 || reply.data.size() != 4 ) throw nano::exception("unexpected packet");
+
+        uint32_t result = 0;
+        for(uint8_t byte : reply.data) result = result * 256 + byte;
+        handler(result);
+    });
+}
+
+void PigroBatch::isp_io(uint32_t cmd, uint32_t &result)
+{
+    isp_io(cmd, [&result] (uint32_t value) { result = value; });
+}
+
+void PigroBatch::jtag_raw_io(uint8_t ir, const uint8_t *data, uint8_t bitcount, reply_handler_t handler)
+{
+    const uint8_t bytecount = (bitcount + 7) / 8;
+    if ( bytecount > PACKET_MAXLEN - 2 ) throw nano::exception("jtag_raw_io(): too many bits: " + std::to_string(bitcount));
+
+    packet_t pkt;
+    pkt.cmd = 8;
+    pkt.len = bytecount + 2;
+    pkt.data[0] = ir;
+    pkt.data[1] = bitcount;
+    for(uint8_t i = 0; i < bytecount; i++) pkt.data[i + 2] = data[i];
+    add(pkt, std::move(handler));
+}
+
+void PigroBatch::execBulk(size_t begin, size_t end)
+{
+    std::vector<uint8_t> request;
+    for(size_t i = begin; i < end; i++)
+    {
+        const packet_t &pkt = m_items[i].pkt;
+        request.push_back(pkt.cmd);
+        request.push_back(pkt.len);
+        request.insert(request.end(), pkt.data, pkt.data + pkt.len);
+    }
+
+    m_link->send_packet(CMD_BATCH, request.data(), request.size());
+
+    bulk_t reply;
+    m_link->recv_packet(&reply);
+    if ( reply.cmd != CMD_BATCH ) throw nano::exception("batch: wrong reply: cmd=" + std::to_string(reply.cmd));
+
+    size_t pos = 0;
+    for(size_t i = begin; i < end; i++)
+    {
+        const item_t &item = m_items[i];
+        if ( !item.handler ) continue;
+
+        if ( pos + 2 > reply.data.size() || pos + 2 + reply.data[pos + 1] > reply.data.size() )
+        {
+            throw nano::exception("batch: reply truncated at command " + std::to_string(i));
+        }
+
+        const auto data = reply.data.begin() + pos + 2;
+        bulk_t frame { reply.data[pos], { data, data + reply.data[pos + 1] } };
+        pos += 2 + frame.data.size();
+
+        if ( frame.cmd != item.pkt.cmd ) throw nano::exception("batch: wrong reply: cmd=" + std::to_string(frame.cmd));
+        item.handler(frame);
+    }
+}
+
+void PigroBatch::execSimple()
+{
+    for(const item_t &item : m_items)
+    {
+        if ( item.pkt.cmd == BATCH_PAUSE )
+        {
+            m_link->wait();
+            QThread::usleep(item.pkt.data[0] * BATCH_TICK_US);
+        }
+        else if ( item.handler )
+        {
+            m_link->transact(&item.pkt, item.handler);
+        }
+        else
+        {
+            m_link->send_packet(&item.pkt);
+        }
+    }
+    m_link->wait();
+}
+
+void PigroBatch::exec()
+{
+    const size_t limit = m_link->bulkSize();
+    if ( limit == 0 )
+    {
+        execSimple();
+        clear();
+        return;
+    }
+
+    // режем на пакеты не больше, чем принимает адаптер
+    size_t begin = 0;
+    size_t size = 0;
+    for(size_t i = 0; i < m_items.size(); i++)
+    {
+        const size_t item_size = m_items[i].pkt.len + 2;
+        if ( size + item_size > limit )
+        {
+            execBulk(begin, i);
+            begin = i;
+            size = 0;
+        }
+        size += item_size;
+    }
+    if ( begin < m_items.size() ) execBulk(begin, m_items.size());
+
+    clear();
+}
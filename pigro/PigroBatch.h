@@ -0,0 +1,89 @@
+#ifndef PIGROBATCH_H
+#define PIGROBATCH_H
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+#include "PigroLink.h"
+
+/**
+ * Пакет команд (batch)
+ *
+ * Команды накапливаются и отправляются адаптеру одним большим пакетом,
+ * адаптер выполняет их подряд и возвращает все ответы одним пакетом.
+ * Если адаптер не поддерживает большие пакеты, то команды отправляются
+ * по одной, результат тот же.
+ *
+ * Обработчики ответов вызываются внутри exec()
+ */
+class PigroBatch
+{
+private:
+
+    struct item_t
+    {
+        packet_t pkt;
+        reply_handler_t handler;
+    };
+
+    PigroLink *m_link;
+
+    std::vector<item_t> m_items { };
+
+    /**
+     * Отправить команды [begin, end) одним большим пакетом
+     */
+    void execBulk(size_t begin, size_t end);
+
+    /**
+     * Отправить команды по одной
+     */
+    void execSimple();
+
+public:
+
+    explicit PigroBatch(PigroLink *link): m_link(link) { }
+
+    /**
+     * Добавить команду
+     *
+     * @param handler обработчик ответа, если он пустой, а команда
+     *                отвечает, то ответ просто пропускается
+     */
+    void add(const packet_t &pkt, reply_handler_t handler = { });
+
+    /**
+     * Пауза между командами
+     */
+    void pause(unsigned msecs);
+
+    /**
+     * Управление линией RESET программируемого контроллера
+     */
+    void isp_reset(bool value);
+
+    /**
+     * Команда программирования (ISP)
+     */
+    void isp_io(uint32_t cmd, std::function<void(uint32_t result)> handler);
+    void isp_io(uint32_t cmd, uint32_t &result);
+
+    /**
+     * Записать IR и прогнать bitcount бит через DR (команда arm_raw_io)
+     */
+    void jtag_raw_io(uint8_t ir, const uint8_t *data, uint8_t bitcount, reply_handler_t handler);
+
+    bool empty() const { return m_items.empty(); }
+    size_t size() const { return m_items.size(); }
+
+    /**
+     * Выполнить накопленные команды и дождаться всех ответов
+     */
+    void exec();
+
+    void clear() { m_items.clear(); }
+
+};
+
+#endif // PIGROBATCH_H
@@ -64,3 +64,9 @@ uint8_t PigroDriver::page_fill() const
 {
     return 0xFF;
 }
+
+uint32_t PigroDriver::base_address() const
+{
+    const std::string value = get_option("base_address");
+    return value.empty() ? 0 : nano::parse_hex<uint32_t>(value);
+}
@@ -14,6 +14,7 @@
 #include "FirmwareInfo.h"
 #include "FirmwareData.h"
 #include "PigroLink.h"
+#include "PigroBatch.h"
 
 class Pigro;
 
@@ -59,6 +60,22 @@ protected:
         return m_link->send_packet(&pkt);
     }
 
+    /**
+     * Отправить команду, на которую адаптер отвечает frames пакетами
+     */
+    bool send_packet(const packet_t &pkt, unsigned frames)
+    {
+        return m_link->send_packet(&pkt, frames);
+    }
+
+    /**
+     * Оставшиеся frames пакетов многопакетного ответа не придут
+     */
+    void cancel_replies(unsigned frames)
+    {
+        m_link->cancelReplies(frames);
+    }
+
     /**
      * Прочитать пакет данных
      */
@@ -67,6 +84,89 @@ protected:
         return m_link->recv_packet(&pkt);
     }
 
+    /**
+     * Отправить большой пакет (bulk frame)
+     */
+    bool send_packet(uint8_t cmd, const uint8_t *data, size_t len)
+    {
+        return m_link->send_packet(cmd, data, len);
+    }
+
+    /**
+     * Прочитать пакет данных произвольной длины
+     */
+    void recv_packet(bulk_t &pkt)
+    {
+        return m_link->recv_packet(&pkt);
+    }
+
+    /**
+     * Отправить команду, ответ будет передан обработчику
+     */
+    void transact(const packet_t &pkt, reply_handler_t handler)
+    {
+        m_link->transact(&pkt, std::move(handler));
+    }
+
+    /**
+     * Отправить команду и дождаться ответа
+     */
+    bulk_t transact(const packet_t &pkt)
+    {
+        return m_link->transact(&pkt);
+    }
+
+    /**
+     * Дождаться ответов на все отправленные команды
+     */
+    void wait_replies()
+    {
+        m_link->wait();
+    }
+
+    /**
+     * Старшая версия протокола адаптера
+     */
+    uint8_t proto_version() const
+    {
+        return m_link->protoVersionMajor();
+    }
+
+    /**
+     * Начать пакет команд, выполняется одним обменом
+     */
+    PigroBatch batch()
+    {
+        return PigroBatch(m_link);
+    }
+
+    /**
+     * Максимальный размер большого пакета, 0 - не поддерживаются
+     */
+    uint16_t bulk_size() const
+    {
+        return m_link->bulkSize();
+    }
+
+    /**
+     * Проверять прошивку по CRC-32, который считает адаптер
+     *
+     * Команды isp_crc/arm_crc есть в тех же версиях адаптера, что и
+     * большие пакеты. verify = readback (pigro.ini) - читать все побайтно
+     */
+    bool crc_verify() const
+    {
+        return bulk_size() > 0 && get_option("verify", "crc") != "readback";
+    }
+
+    /**
+     * Можно ли отправлять команды пачкой, не дожидаясь ответа на каждую
+     */
+    bool windowed() const
+    {
+        return m_link->windowed();
+    }
+
     static void dump_packet(const char *message, const packet_t &pkt)
     {
         printf("%s [cmd=0x%02X]:", message, pkt.cmd);
@@ -120,6 +220,21 @@ public:
     virtual uint32_t page_count() const = 0;
     virtual uint8_t page_fill() const;
 
+    /**
+     * Адрес загрузки двоичной прошивки (параметр base_address в pigro.ini)
+     */
+    virtual uint32_t base_address() const;
+
+    /**
+     * Брать разобранную прошивку из кеша ~/.pigro/cache
+     *
+     * cache = yes (pigro.ini), по умолчанию выключен
+     */
+    bool firmware_cache() const
+    {
+        return get_option("cache", "no") == "yes";
+    }
+
     virtual QString getIspChipInfo() = 0;
     virtual FirmwareData readFirmware() = 0;
 
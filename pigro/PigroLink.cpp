@@ -1,43 +1,238 @@
 #include "PigroLink.h"
 #include "Pigro.h"
 #include <nano/exception.h>
+#include <nano/crc.h>
 #include "trace.h"
+#include <cstring>
+#include <QThread>
 
 constexpr uint8_t PKT_ACK = 1;
 constexpr uint8_t PKT_NACK = 2;
 
+constexpr uint8_t PKT_WINDOW_ACK = 0x80;
+constexpr uint8_t PKT_WINDOW_NACK = 0xC0;
+constexpr uint8_t PKT_SEQ_MASK = 0x3F;
 
-uint8_t PigroLink::readBlocked()
+constexpr uint8_t PKT_BULK = 0x7F;
+
+constexpr uint8_t CMD_PROTO_CONFIG = 17;
+
+/**
+ * Сколько пакетов мы хотели бы держать в пути, адаптер может уменьшить
+ */
+constexpr uint8_t LINK_WINDOW = 8;
+
+/**
+ * Скорость, на которой адаптер начинает сессию
+ */
+constexpr uint32_t LINK_DEFAULT_BAUD = 9600;
+
+/**
+ * Пауза перед проверкой новой скорости, адаптер должен успеть отправить
+ * ответ и переключиться
+ */
+constexpr int BAUD_SWITCH_DELAY = 100;
+
+/**
+ * Сколько адаптер ждет проверочный пакет на новой скорости (с запасом)
+ */
+constexpr int BAUD_PROBE_TIMEOUT = 600;
+
+/**
+ * Сколько раз повторять эхо и подтверждение на новой скорости
+ */
+constexpr int BAUD_PROBE_RETRIES = 3;
+
+
+void PigroLink::resetInput()
 {
-    char data;
-    if ( serial->read(&data, 1) == 1 )
+    m_rx.clear();
+    m_rx_state = rx_state_t::head;
+    m_ack_pending = false;
+    m_pending = 0;
+    m_replies.clear();
+    m_handlers.clear();
+}
+
+bool PigroLink::waitInput(int msecs)
+{
+    // данные забирает serialReadyRead(), который вызывается
+    // изнутри waitForReadyRead()
+    m_waiting = true;
+    const bool ready = serial->waitForReadyRead(msecs);
+    m_waiting = false;
+    return ready;
+}
+
+void PigroLink::waitFor(const std::function<bool()> &ready)
+{
+    processInput();
+    while ( !ready() )
     {
-        return data;
+        if ( !waitInput() )
+        {
+            throw nano::exception("read timeout");
+        }
+        processInput();
     }
+}
 
-    if ( serial->waitForReadyRead(200) )
+void PigroLink::processInput()
+{
+    uint8_t byte;
+    while ( m_rx.read(&byte) )
     {
-        char data;
-        if ( serial->read(&data, 1) == 1 )
+        switch ( m_rx_state )
         {
-            return data;
+        case rx_state_t::head:
+            if ( windowed() && (byte & PKT_WINDOW_ACK) )
+            {
+                acceptWindowAck(byte);
+                break;
+            }
+            if ( m_ack_pending )
+            {
+                acceptAck(byte);
+                break;
+            }
+            if ( byte == PKT_BULK )
+            {
+                m_rx_state = rx_state_t::bulk_cmd;
+                break;
+            }
+            m_rx_frame.cmd = byte;
+            m_rx_state = rx_state_t::len;
+            break;
+
+        case rx_state_t::len:
+            if ( byte > PACKET_MAXLEN )
+            {
+                m_rx_state = rx_state_t::head;
+                throw nano::exception("packet to big: " + std::to_string(byte) + "/" + std::to_string((PACKET_MAXLEN)));
+            }
+            m_rx_len = byte;
+            m_rx_frame.data.clear();
+            m_rx_state = rx_state_t::data;
+            if ( m_rx_len == 0 ) acceptFrame();
+            break;
+
+        case rx_state_t::data:
+            m_rx_frame.data.push_back(byte);
+            if ( m_rx_frame.data.size() == m_rx_len ) acceptFrame();
+            break;
+
+        case rx_state_t::bulk_cmd:
+            m_rx_frame.cmd = byte;
+            m_rx_crc = nano::crc16_update(0xFFFF, byte);
+            m_rx_state = rx_state_t::bulk_len_lo;
+            break;
+
+        case rx_state_t::bulk_len_lo:
+            m_rx_len = byte;
+            m_rx_crc = nano::crc16_update(m_rx_crc, byte);
+            m_rx_state = rx_state_t::bulk_len_hi;
+            break;
+
+        case rx_state_t::bulk_len_hi:
+            m_rx_len |= uint16_t(byte) << 8;
+            m_rx_crc = nano::crc16_update(m_rx_crc, byte);
+            if ( m_rx_len > m_bulk_size )
+            {
+                m_rx_state = rx_state_t::head;
+                throw nano::exception("bulk frame to big: " + std::to_string(m_rx_len) + "/" + std::to_string(m_bulk_size));
+            }
+            m_rx_frame.data.clear();
+            m_rx_frame.data.reserve(m_rx_len);
+            m_rx_state = m_rx_len ? rx_state_t::bulk_data : rx_state_t::crc_lo;
+            break;
+
+        case rx_state_t::bulk_data:
+            m_rx_frame.data.push_back(byte);
+            m_rx_crc = nano::crc16_update(m_rx_crc, byte);
+            if ( m_rx_frame.data.size() == m_rx_len ) m_rx_state = rx_state_t::crc_lo;
+            break;
+
+        case rx_state_t::crc_lo:
+            m_rx_crc_lo = byte;
+            m_rx_state = rx_state_t::crc_hi;
+            break;
+
+        case rx_state_t::crc_hi:
+            if ( m_rx_crc != (m_rx_crc_lo | (uint16_t(byte) << 8)) )
+            {
+                m_rx_state = rx_state_t::head;
+                throw nano::exception("bulk frame CRC mismatch");
+            }
+            acceptFrame();
+            break;
         }
+    }
+}
 
-        throw nano::exception("read fail: " + serial->errorString().toStdString());
+void PigroLink::acceptWindowAck(uint8_t token)
+{
+    const uint8_t seq = token & PKT_SEQ_MASK;
+    if ( m_inflight == 0 )
+    {
+        throw nano::exception("recv_frame(): unexpected ACK, seq = " + std::to_string(seq));
     }
-    else
+    if ( seq != m_ack_seq )
     {
-        // timeout
-        throw nano::exception("read timeout");
+        throw nano::exception("recv_frame(): ACK out of sequence: " + std::to_string(seq) + "/" + std::to_string(m_ack_seq));
+    }
+
+    m_ack_seq = (m_ack_seq + 1) & PKT_SEQ_MASK;
+    m_inflight--;
+
+    if ( (token & PKT_WINDOW_NACK) == PKT_WINDOW_NACK )
+    {
+        throw nano::exception("send_packet(): NACK, seq = " + std::to_string(seq));
     }
 }
 
+void PigroLink::acceptAck(uint8_t token)
+{
+    m_ack_pending = false;
+    switch ( token )
+    {
+    case PKT_ACK: return;
+    case PKT_NACK: throw nano::exception("send_packet(): NACK");
+    default: throw nano::exception("send_packet(): out of sync");
+    }
+}
+
+void PigroLink::acceptFrame()
+{
+    m_rx_state = rx_state_t::head;
+
+    bulk_t frame { m_rx_frame.cmd, std::move(m_rx_frame.data) };
+    m_rx_frame.data = { };
+    if ( m_pending ) m_pending--;
+
+    if ( m_handlers.empty() )
+    {
+        m_replies.push_back(std::move(frame));
+        return;
+    }
+
+    // обработчик может сам отправлять команды, поэтому снимаем его
+    // с очереди до вызова
+    const reply_handler_t handler = std::move(m_handlers.front());
+    m_handlers.pop_front();
+    handler(frame);
+}
+
 void PigroLink::checkProtoVersion()
 {
-    serial->waitForReadyRead(200);
+    // выбрасываем мусор, оставшийся в линии, не дожидаясь новых данных
     serial->readAll();
+    resetInput();
 
     nack_support = false;
+    m_window = 0;
+    m_inflight = 0;
+    m_ack_seq = 0;
+    m_bulk_size = 0;
 
     packet_t pkt;
     pkt.cmd = 1;
@@ -46,18 +241,20 @@ void PigroLink::checkProtoVersion()
     pkt.data[1] = 0;
     send_packet(&pkt);
 
-    if ( serial->waitForReadyRead(200) )
+    // быстрый адаптер успевает ответить, пока идет отправка, и ответ уже
+    // лежит в m_rx (waitForReadyRead() ждет только новые данные)
+    uint8_t ack;
+    if ( (!m_rx.empty() || waitInput()) && m_rx.read(&ack) )
     {
-        char ack;
-        serial->read(&ack, sizeof(ack));
         if ( ack == PKT_ACK )
         {
+            nack_support = true;
             recv_packet(&pkt);
             if ( pkt.len != 2 )
                 throw nano::exception("wrong protocol: len = " + std::to_string(pkt.len));
-            nack_support = true;
             m_protoVersionMajor = pkt.data[0];
             m_protoVersionMinor = pkt.data[1];
+            if ( m_protoVersionMajor >= 1 ) negotiate();
             return;
         }
         else
@@ -66,11 +263,107 @@ void PigroLink::checkProtoVersion()
         }
     }
 
+    // старый адаптер на команду 1 не отвечает
     nack_support = false;
+    m_pending = 0;
     m_protoVersionMajor = 0;
     m_protoVersionMinor = 1;
 }
 
+uint32_t PigroLink::protoConfig(uint8_t param, uint32_t value, uint8_t bytecount)
+{
+    packet_t pkt;
+    pkt.cmd = CMD_PROTO_CONFIG;
+    pkt.len = bytecount + 1;
+    pkt.data[0] = param;
+    for(uint8_t i = 0; i < bytecount; i++)
+    {
+        pkt.data[i + 1] = (value >> (i * 8)) & 0xFF;
+    }
+
+    send_packet(&pkt);
+    recv_packet(&pkt);
+    if ( pkt.cmd != CMD_PROTO_CONFIG || pkt.len != bytecount + 1 || pkt.data[0] != param )
+    {
+        throw nano::exception("protoConfig(" + std::to_string(param) + "): unexpected reply");
+    }
+
+    uint32_t result = 0;
+    for(uint8_t i = 0; i < bytecount; i++)
+    {
+        result |= uint32_t(pkt.data[i + 1]) << (i * 8);
+    }
+    return result;
+}
+
+void PigroLink::negotiateBaudRate()
+{
+    m_baud_rate = LINK_DEFAULT_BAUD;
+    if ( m_baud_request == LINK_DEFAULT_BAUD ) return;
+
+    const uint32_t rate = protoConfig(3, m_baud_request, 4);
+    if ( rate == 0 )
+    {
+        trace::log(QStringLiteral("PigroLink baud rate %1 not supported by adapter").arg(m_baud_request));
+        return;
+    }
+
+    QThread::msleep(BAUD_SWITCH_DELAY);
+    serial->setBaudRate(rate);
+
+    // адаптер остается на новой скорости, только получив подтверждение
+    // (параметр 5). Потерянный ответ не повод уходить на 9600: адаптер
+    // мог его отправить и ждет следующий пакет, поэтому сначала
+    // повторяем запрос на новой скорости
+    constexpr uint8_t probe = 0x5A;
+    if ( baudProbe(4, probe) && baudProbe(5, probe) )
+    {
+        m_baud_rate = rate;
+        return;
+    }
+
+    // адаптер сам вернется на скорость по умолчанию, не дождавшись
+    // корректного пакета
+    serial->setBaudRate(LINK_DEFAULT_BAUD);
+    QThread::msleep(BAUD_PROBE_TIMEOUT);
+    serial->clear();
+    resetInput();
+}
+
+bool PigroLink::baudProbe(uint8_t param, uint8_t value)
+{
+    for(int i = 0; i < BAUD_PROBE_RETRIES; i++)
+    {
+        try
+        {
+            if ( protoConfig(param, value, 1) == value ) return true;
+        }
+        catch (const nano::exception &e)
+        {
+            trace::log(QStringLiteral("PigroLink baud rate %1 probe failed: %2").arg(serial->baudRate()).arg(e.what()));
+        }
+
+        // остатки битого ответа не должны попасть в следующую попытку
+        serial->clear();
+        resetInput();
+    }
+    return false;
+}
+
+void PigroLink::negotiate()
+{
+    m_bulk_size = protoConfig(2, BULK_MAXLEN, 2);
+
+    negotiateBaudRate();
+
+    // адаптер переключается сразу после отправки ответа
+    m_window = protoConfig(1, LINK_WINDOW, 1);
+    m_inflight = 0;
+    m_ack_seq = 0;
+
+    trace::log(QStringLiteral("PigroLink window: %1, bulk size: %2, baud rate: %3").arg(window()).arg(m_bulk_size).arg(m_baud_rate));
+}
+
 void PigroLink::serialErrorOccurred(QSerialPort::SerialPortError error)
 {
     if ( error == QSerialPort::NoError )
@@ -85,46 +378,165 @@ void PigroLink::serialErrorOccurred(QSerialPort::SerialPortError error)
     emit errorOccurred(QString::fromUtf8(buf, len));
 }
 
-bool PigroLink::send_packet(const packet_t *pkt)
+void PigroLink::serialReadyRead()
+{
+    const QByteArray data = serial->readAll();
+    m_rx.write(reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+
+    if ( m_waiting ) return;
+
+    // асинхронный режим: поток крутит цикл событий, ответы раздаем сразу
+    try
+    {
+        processInput();
+    }
+    catch (const std::exception &e)
+    {
+        emit errorOccurred(QStringLiteral("error: %1").arg(e.what()));
+    }
+}
+
+bool PigroLink::sendFrame(const char *data, size_t size, unsigned frames)
 {
-    ssize_t r = serial->write(reinterpret_cast<const char *>(pkt), pkt->len + 2);
-    serial->waitForBytesWritten(200);
-    if ( r != pkt->len + 2 )
+    m_pending += frames;
+
+    // подтверждение может прийти еще внутри waitForBytesWritten(),
+    // поэтому ждать его начинаем до отправки
+    if ( windowed() ) m_inflight++;
+    else if ( nack_support ) m_ack_pending = true;
+
+    // пришедшие пока байты serialReadyRead() только складывает
+    // в буфер, разбирает их waitFor() ниже, и ошибки протокола
+    // уходят вызывающему, а не в errorOccurred
+    const bool waiting = m_waiting;
+    m_waiting = true;
+    ssize_t r = serial->write(data, size);
+    serial->waitForBytesWritten(200 + size);
+    m_waiting = waiting;
+
+    if ( r != ssize_t(size) )
     {
         // TODO обработка ошибок
         throw nano::exception("send_packet(): send fail");
     }
 
+    if ( windowed() )
+    {
+        // ответы, пришедшие раньше подтверждений, складываются в очередь
+        waitFor([this] { return m_inflight < m_window; });
+        return true;
+    }
+
     if ( nack_support )
     {
-        switch ( readBlocked() )
-        {
-        case PKT_ACK: return true;
-        case PKT_NACK: throw nano::exception("send_packet(): NACK");
-        default: throw nano::exception("send_packet(): out of sync");
-        }
+        waitFor([this] { return !m_ack_pending; });
     }
 
     return true;
 }
 
-void PigroLink::recv_packet(packet_t *pkt)
+bool PigroLink::send_packet(const packet_t *pkt)
+{
+    return send_packet(pkt, commandHasReply(pkt->cmd) ? 1 : 0);
+}
+
+bool PigroLink::send_packet(const packet_t *pkt, unsigned frames)
+{
+    // в режиме stop-and-wait подтверждение не отличить от ответа,
+    // поэтому сначала дожидаемся ответов на предыдущие команды
+    if ( !windowed() ) wait();
+
+    return sendFrame(reinterpret_cast<const char *>(pkt), pkt->len + 2, frames);
+}
+
+void PigroLink::cancelReplies(unsigned frames)
 {
-    pkt->cmd = readBlocked();
-    pkt->len = readBlocked();
-    if ( pkt->len > PACKET_MAXLEN )
+    m_pending = (frames < m_pending) ? m_pending - frames : 0;
+}
+
+bool PigroLink::send_packet(uint8_t cmd, const uint8_t *data, size_t len)
+{
+    if ( len > m_bulk_size )
     {
-        throw nano::exception("packet to big: " + std::to_string(pkt->len) + "/" + std::to_string((PACKET_MAXLEN)));
+        throw nano::exception("send_packet(): bulk frame to big: " + std::to_string(len) + "/" + std::to_string(m_bulk_size));
     }
-    for(int i = 0; i < pkt->len; i++)
+
+    // адаптер подтверждает команду до ее выполнения, поэтому ждать
+    // только ACK мало: пока он занят длинной командой (isp_crc и т.п.),
+    // большой пакет переполнит его приемный буфер (64 байта).
+    // Дожидаемся ответов на все отправленные команды
+    wait();
+
+    std::vector<char> frame(len + 6);
+    frame[0] = PKT_BULK;
+    frame[1] = cmd;
+    frame[2] = len & 0xFF;
+    frame[3] = len >> 8;
+    memcpy(frame.data() + 4, data, len);
+    const uint16_t crc = nano::crc16(reinterpret_cast<const uint8_t *>(frame.data() + 1), len + 3);
+    frame[len + 4] = crc & 0xFF;
+    frame[len + 5] = crc >> 8;
+
+    return sendFrame(frame.data(), frame.size(), 1);
+}
+
+void PigroLink::recv_packet(bulk_t *pkt)
+{
+    waitFor([this] { return !m_replies.empty(); });
+    *pkt = std::move(m_replies.front());
+    m_replies.pop_front();
+}
+
+void PigroLink::recv_packet(packet_t *pkt)
+{
+    bulk_t frame;
+    recv_packet(&frame);
+    if ( frame.data.size() > PACKET_MAXLEN )
     {
-        pkt->data[i] = readBlocked();
+        throw nano::exception("packet to big: " + std::to_string(frame.data.size()) + "/" + std::to_string((PACKET_MAXLEN)));
     }
+
+    pkt->cmd = frame.cmd;
+    pkt->len = frame.data.size();
+    memcpy(pkt->data, frame.data.data(), frame.data.size());
+}
+
+void PigroLink::transact(const packet_t *pkt, reply_handler_t handler)
+{
+    if ( !windowed() ) wait();
+
+    // обработчик ставится в очередь до отправки: в оконном режиме
+    // ответ может прийти, пока мы ждем место в окне
+    m_handlers.push_back(std::move(handler));
+    sendFrame(reinterpret_cast<const char *>(pkt), pkt->len + 2, 1);
+}
+
+bulk_t PigroLink::transact(const packet_t *pkt)
+{
+    bulk_t reply;
+    bool done = false;
+    transact(pkt, [&reply, &done] (const bulk_t &frame) {
+        reply = frame;
+        done = true;
+    });
+    waitFor([&done] { return done; });
+    return reply;
+}
+
+void PigroLink::flush()
+{
+    waitFor([this] { return m_inflight == 0; });
+}
+
+void PigroLink::wait()
+{
+    waitFor([this] { return m_inflight == 0 && m_pending == 0; });
 }
 
 PigroLink::PigroLink(QObject *parent): QObject(parent)
 {
     connect(serial, &QSerialPort::errorOccurred, this, &PigroLink::serialErrorOccurred, Qt::DirectConnection);
+    connect(serial, &QSerialPort::readyRead, this, &PigroLink::serialReadyRead, Qt::DirectConnection);
 
     trace::log("PigroLink created");
 }
@@ -138,7 +550,11 @@ QString PigroLink::protoVersion() const
 {
     if ( nack_support )
     {
-        return QStringLiteral("%1.%2 (NACK support)").arg(protoVersionMajor()).arg(protoVersionMinor());
+        QString features = QStringLiteral("NACK support");
+        if ( windowed() ) features += QStringLiteral(", window %1").arg(window());
+        if ( m_bulk_size ) features += QStringLiteral(", bulk %1").arg(m_bulk_size);
+        features += QStringLiteral(", %1 baud").arg(m_baud_rate);
+        return QStringLiteral("%1.%2 (%3)").arg(protoVersionMajor()).arg(protoVersionMinor()).arg(features);
     }
     else
     {
@@ -149,7 +565,8 @@ QString PigroLink::protoVersion() const
 bool PigroLink::open(const QString &tty)
 {
     serial->setPortName(tty);
-    serial->setBaudRate(QSerialPort::Baud9600);
+    serial->setBaudRate(LINK_DEFAULT_BAUD);
+    m_baud_rate = LINK_DEFAULT_BAUD;
     serial->setDataBits(QSerialPort::Data8);
     if ( serial->open(QIODevice::ReadWrite) )
     {
@@ -184,6 +601,10 @@ void PigroLink::close()
     {
         emit sessionStopped();
         serial->close();
+        m_window = 0;
+        m_inflight = 0;
+        m_bulk_size = 0;
+        resetInput();
         trace::log(QStringLiteral("PigroLink %1 closed").arg(serial->portName()));
     }
 }
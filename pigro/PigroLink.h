@@ -2,9 +2,19 @@
 #define PIGROLINK_H
 
 #include <QSerialPort>
+#include <deque>
+#include <vector>
+#include <functional>
+
+#include <nano/ringbuf.h>
 
 constexpr auto PACKET_MAXLEN = 12;
 
+/**
+ * Максимальный размер большого пакета (bulk frame)
+ */
+constexpr auto BULK_MAXLEN = 256;
+
 struct packet_t
 {
     unsigned char cmd;
@@ -12,12 +22,45 @@ struct packet_t
     unsigned char data[PACKET_MAXLEN];
 };
 
+/**
+ * Пакет произвольной длины
+ *
+ * Большие пакеты передаются с CRC-16 и поддерживаются адаптером начиная
+ * с версии протокола 1, обычные пакеты тоже можно читать в эту структуру
+ */
+struct bulk_t
+{
+    unsigned char cmd;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * Обработчик ответа на команду, отправленную через PigroLink::transact()
+ */
+using reply_handler_t = std::function<void(const bulk_t &reply)>;
+
 class PigroLink: public QObject
 {
     Q_OBJECT
 
 private:
 
+    /**
+     * Состояние разбора входящего потока
+     */
+    enum class rx_state_t
+    {
+        head,
+        len,
+        data,
+        bulk_cmd,
+        bulk_len_lo,
+        bulk_len_hi,
+        bulk_data,
+        crc_lo,
+        crc_hi
+    };
+
     QSerialPort *serial { new QSerialPort(this) };
 
     bool nack_support { false };
@@ -25,20 +68,200 @@ private:
     uint8_t m_protoVersionMajor { 0 };
     uint8_t m_protoVersionMinor { 0 };
 
-    uint8_t readBlocked();
+    /**
+     * Размер окна, 0 - режим stop-and-wait
+     */
+    uint8_t m_window { 0 };
+
+    /**
+     * Число отправленных, но еще не подтвержденных пакетов
+     */
+    uint8_t m_inflight { 0 };
+
+    /**
+     * Порядковый номер ожидаемого подтверждения
+     */
+    uint8_t m_ack_seq { 0 };
+
+    /**
+     * Максимальный размер большого пакета, 0 - не поддерживаются
+     */
+    uint16_t m_bulk_size { 0 };
+
+    /**
+     * Скорость, которую предложить адаптеру
+     */
+    uint32_t m_baud_request { 115200 };
+
+    /**
+     * Текущая скорость линии
+     */
+    uint32_t m_baud_rate { 9600 };
+
+    /**
+     * Принятые, но еще не разобранные байты
+     *
+     * Заполняется в обработчике readyRead целиком, сколько пришло
+     */
+    nano::ringbuf m_rx { };
+
+    rx_state_t m_rx_state { rx_state_t::head };
+
+    /**
+     * Собираемый пакет
+     */
+    bulk_t m_rx_frame { };
+    uint16_t m_rx_len { 0 };
+    uint16_t m_rx_crc { 0 };
+    uint8_t m_rx_crc_lo { 0 };
+
+    /**
+     * Сколько пакетов ответа еще должно прийти на отправленные команды
+     * (isp_read_block и arm_read_block отвечают несколькими пакетами)
+     */
+    unsigned m_pending { 0 };
+
+    /**
+     * Ожидается подтверждение ACK/NACK в режиме stop-and-wait
+     */
+    bool m_ack_pending { false };
+
+    /**
+     * Идет синхронный обмен (ожидание в waitForReadyRead() или отправка
+     * в sendFrame()), принятые байты разберет он, а не serialReadyRead()
+     */
+    bool m_waiting { false };
+
+    /**
+     * Ответы, прочитанные раньше, чем их запросили
+     */
+    std::deque<bulk_t> m_replies { };
+
+    /**
+     * Обработчики ответов на команды, отправленные через transact(),
+     * в порядке отправки
+     */
+    std::deque<reply_handler_t> m_handlers { };
+
+    /**
+     * Сбросить приемный буфер и состояние разбора
+     */
+    void resetInput();
+
+    /**
+     * Дождаться новых данных
+     *
+     * @return false по таймауту
+     */
+    bool waitInput(int msecs = 200);
+
+    /**
+     * Разбирать входящие данные, пока не выполнится условие
+     */
+    void waitFor(const std::function<bool()> &ready);
+
+    /**
+     * Разобрать все накопленные байты
+     *
+     * Подтверждения обрабатываются сразу, готовые пакеты передаются
+     * обработчикам transact() или складываются в очередь m_replies
+     */
+    void processInput();
+
+    /**
+     * Обработать подтверждение ACK/NACK (оконный режим)
+     */
+    void acceptWindowAck(uint8_t token);
+
+    /**
+     * Обработать подтверждение ACK/NACK (режим stop-and-wait)
+     */
+    void acceptAck(uint8_t token);
+
+    /**
+     * Пакет собран целиком
+     */
+    void acceptFrame();
+
+    /**
+     * Отправить пакет и дождаться подтверждения (или поставить
+     * в очередь в оконном режиме)
+     *
+     * @param frames сколько пакетов адаптер пришлет в ответ
+     */
+    bool sendFrame(const char *data, size_t size, unsigned frames);
 
     void checkProtoVersion();
 
+    /**
+     * Установить параметр протокола (команда proto_config)
+     *
+     * @return значение, принятое адаптером
+     */
+    uint32_t protoConfig(uint8_t param, uint32_t value, uint8_t bytecount);
+
+    /**
+     * Переключить адаптер на скорость m_baud_request
+     *
+     * Если после переключения связь не подтвердилась, то обе стороны
+     * возвращаются на 9600
+     */
+    void negotiateBaudRate();
+
+    /**
+     * Отправить proto_config с однобайтным значением на новой скорости,
+     * при неудаче повторить до BAUD_PROBE_RETRIES раз
+     *
+     * @return true если адаптер вернул то же значение
+     */
+    bool baudProbe(uint8_t param, uint8_t value);
+
+    /**
+     * Согласовать с адаптером размер окна, больших пакетов и скорость
+     */
+    void negotiate();
+
 private slots:
 
     void serialErrorOccurred(QSerialPort::SerialPortError error);
 
+    void serialReadyRead();
+
 public:
 
+    /**
+     * Адаптер отвечает на все команды, кроме isp_reset, adc, jtag_test
+     * и паузы внутри batch (0)
+     */
+    static bool commandHasReply(uint8_t cmd)
+    {
+        return cmd != 0 && cmd != 2 && cmd != 4 && cmd != 5;
+    }
+
     QString protoVersion() const;
     uint8_t protoVersionMajor() const { return m_protoVersionMajor; }
     uint8_t protoVersionMinor() const { return m_protoVersionMinor; }
 
+    /**
+     * Оконный режим: можно отправлять несколько пакетов не дожидаясь
+     * ответов, ответы читаются потом в том же порядке
+     */
+    bool windowed() const { return m_window != 0; }
+    uint8_t window() const { return m_window ? m_window : 1; }
+
+    /**
+     * Максимальный размер большого пакета, 0 - не поддерживаются
+     */
+    uint16_t bulkSize() const { return m_bulk_size; }
+
+    uint32_t baudRate() const { return m_baud_rate; }
+
+    /**
+     * Скорость, которую предложить адаптеру при следующем открытии
+     * (9600 - не переключать)
+     */
+    void setBaudRate(uint32_t rate) { m_baud_request = rate; }
+
     QString errorString()
     {
         return serial->errorString();
@@ -60,11 +283,64 @@ public:
      */
     bool send_packet(const packet_t *pkt);
 
+    /**
+     * Отправить команду, на которую адаптер отвечает несколькими
+     * пакетами (isp_read_block, arm_read_block)
+     *
+     * @param frames сколько пакетов ответа ожидается
+     */
+    bool send_packet(const packet_t *pkt, unsigned frames);
+
+    /**
+     * Адаптер прервал ответ из нескольких пакетов (ошибка), оставшиеся
+     * frames пакетов не придут
+     */
+    void cancelReplies(unsigned frames);
+
+    /**
+     * Отправить большой пакет (bulk frame)
+     */
+    bool send_packet(uint8_t cmd, const uint8_t *data, size_t len);
+
     /**
      * Прочитать пакет данных
      */
     void recv_packet(packet_t *pkt);
 
+    /**
+     * Прочитать пакет данных произвольной длины
+     */
+    void recv_packet(bulk_t *pkt);
+
+    /**
+     * Отправить команду, ответ будет передан обработчику
+     *
+     * Обработчик вызывается из разбора входящих данных: либо внутри
+     * следующего вызова PigroLink, который ждет данные (wait(),
+     * send_packet() и т.п.), либо из readyRead, если поток крутит
+     * цикл событий. Ответы на команды, отправленные через send_packet(),
+     * и через transact() не должны быть в пути одновременно, так как
+     * ответы никак не помечены и раздаются строго по порядку.
+     */
+    void transact(const packet_t *pkt, reply_handler_t handler);
+
+    /**
+     * Отправить команду и дождаться ответа
+     */
+    bulk_t transact(const packet_t *pkt);
+
+    /**
+     * Дождаться подтверждения всех отправленных пакетов
+     */
+    void flush();
+
+    /**
+     * Дождаться подтверждений и ответов на все отправленные команды
+     *
+     * Ответы на команды send_packet() остаются в очереди для recv_packet()
+     */
+    void wait();
+
     void close();
 
 signals:
@@ -49,6 +49,21 @@ function is_param($str, &$param, &$value)
     return false;
 }
 
+/**
+ * Начало многострочного параметра (инструкции ISP): name = "...",
+ * значение - только первая строка, важно само наличие параметра
+ */
+function is_multiline_param($str, &$param, &$value)
+{
+    if ( preg_match("/^\s*([a-zA-Z_0-9]+)\s*=\s*\"([^\"]*)\"\s*,\s*$/s", $str, $match) )
+    {
+        $param = $match[1];
+        $value = trim($match[2]);
+        return true;
+    }
+    return false;
+}
+
 function is_power_of_two(int $value)
 {
     if ( $value <= 0 ) return false;
@@ -139,6 +154,10 @@ try
     foreach($lines as $line_t)
     {
         $lineno ++;
+
+        // комментарии /* ... */ в конце строки параметра
+        $line_t = preg_replace("#/\*.*?\*/#", "", $line_t);
+
         if ( is_empty($line_t) ) continue;
         if ( is_section($line_t, $s) )
         {
@@ -188,7 +207,7 @@ try
             error("unexpected end of section, line: $lineno");
             continue;
         }
-        if ( is_param($line_t, $param, $value) )
+        if ( is_param($line_t, $param, $value) || is_multiline_param($line_t, $param, $value) )
         {
             if ( $section == "part" )
             {
@@ -279,6 +298,51 @@ try
             $config["page_size"] = $page_size;
             $config["page_count"] = $page_count;
         }
+        else if ( isset($part["memory"]["flash"]["size"]) && isset($part["param"]["pgm_enable"]) )
+        {
+            // побайтовая запись: размер флеш в байтах и что читается
+            // из ячейки во время записи (для опроса готовности).
+            // Только для чипов с ISP (есть инструкция Programming Enable),
+            // XMEGA (PDI) и ATtiny4/5/9/10 (TPI) так не прошить
+            $config["flash_size"] = parse_int($part["memory"]["flash"]["size"]);
+            if ( isset($part["memory"]["flash"]["readback_p1"]) )
+            {
+                $config["flash_readback"] = sprintf("0x%02X", parse_int($part["memory"]["flash"]["readback_p1"]));
+            }
+        }
+
+        // EEPROM: размер страницы в байтах (1 - только побайтовая запись)
+        //
+        // page_size в avrdude.conf задан и для параллельного программирования,
+        // страничная запись по ISP есть, только если описаны инструкции
+        // loadpage_lo (0xC1) и writepage (0xC2)
+        $eeprom = isset($part["memory"]["eeprom"]) ? $part["memory"]["eeprom"] : array();
+        $eeprom_size = isset($eeprom["size"]) ? parse_int($eeprom["size"]) : 0;
+        if ( $eeprom_size > 0 )
+        {
+            $eeprom_paged = isset($eeprom["loadpage_lo"]) && isset($eeprom["writepage"]) && isset($eeprom["page_size"]);
+            $eeprom_page_size = $eeprom_paged ? parse_int($eeprom["page_size"]) : 1;
+            $config["eeprom_page_size"] = $eeprom_page_size;
+            $config["eeprom_page_count"] = intdiv($eeprom_size, $eeprom_page_size);
+        }
+
+        // задержки записи (мкс), используются если чип не умеет Poll RDY/BSY
+        if ( isset($part["memory"]["flash"]["max_write_delay"]) )
+        {
+            $config["flash_write_delay"] = parse_int($part["memory"]["flash"]["max_write_delay"]);
+        }
+        if ( isset($part["memory"]["eeprom"]["max_write_delay"]) )
+        {
+            $config["eeprom_write_delay"] = parse_int($part["memory"]["eeprom"]["max_write_delay"]);
+        }
+        if ( isset($part["param"]["chip_erase_delay"]) )
+        {
+            $config["chip_erase_delay"] = parse_int($part["param"]["chip_erase_delay"]);
+        }
+
+        // Poll RDY/BSY есть у всех чипов со страничной записью,
+        // у старых AT90S/ATtiny1x его нет
+        $config["rdy_bsy"] = ($paged ? "yes" : "no");
 
         if ( isset($parts[$name]) )
         {
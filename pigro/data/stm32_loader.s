@@ -0,0 +1,53 @@
+@ STM32F1 flash loader
+@
+@ r0 - mailbox address, see ARM::LOADER_* constants
+@ mailbox: +0 status, +4 buf0.dst, +8 buf0.size, +12 buf0.src,
+@          +16 buf1.dst, +20 buf1.size, +24 buf1.src
+@
+@ build:
+@   llvm-mc --triple=thumbv7m-none-eabi -filetype=obj stm32_loader.s -o stm32_loader.o
+@   llvm-objcopy -O binary stm32_loader.o stm32_loader.bin
+
+    .syntax unified
+    .cpu cortex-m3
+    .thumb
+
+start:
+    ldr     r1, fpec            @ FPEC base
+    movs    r7, #0x34           @ reset EOP, WRPRTERR, PGERR
+    str     r7, [r1, #0x0C]
+    movs    r2, #0              @ current buffer descriptor offset
+next:
+    adds    r3, r0, r2
+wait:
+    ldr     r5, [r3, #8]        @ size, 0 - buffer is empty
+    cmp     r5, #0
+    beq     wait
+    ldr     r4, [r3, #4]        @ dst
+    ldr     r6, [r3, #12]       @ src
+    movs    r7, #1              @ FLASH_CR_PG
+    str     r7, [r1, #0x10]
+program:
+    ldrh    r7, [r6], #2
+    strh    r7, [r4], #2
+busy:
+    ldr     r7, [r1, #0x0C]     @ FLASH_SR
+    tst     r7, #1              @ BSY
+    bne     busy
+    tst     r7, #0x14           @ PGERR | WRPRTERR
+    bne     error
+    subs    r5, r5, #2
+    bne     program
+    movs    r7, #0
+    str     r7, [r1, #0x10]     @ FLASH_CR = 0
+    str     r7, [r3, #8]        @ buffer is free
+    eor     r2, r2, #12
+    b       next
+error:
+    str     r7, [r0]            @ status = FLASH_SR
+    movs    r7, #0
+    str     r7, [r1, #0x10]
+    bkpt    #0
+    .align 2
+fpec:
+    .word   0x40022000
@@ -0,0 +1,46 @@
+#include "crc.h"
+
+#include <cstring>
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDull;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t nano::hash64(const uint8_t *data, size_t size, uint64_t seed)
+{
+    constexpr uint64_t c1 = 0x87C37B91114253D5ull;
+    constexpr uint64_t c2 = 0x4CF5AD432745937Full;
+
+    uint64_t h = seed ^ (size * c1);
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, data + i, sizeof(k));
+        k *= c1;
+        k = rotl64(k, 31);
+        k *= c2;
+        h ^= k;
+        h = rotl64(h, 27) * 5 + 0x52DCE729;
+    }
+
+    uint64_t tail = 0;
+    for(size_t j = 0; i + j < size; j++) tail |= uint64_t(data[i + j]) << (j * 8);
+    tail *= c1;
+    tail = rotl64(tail, 31);
+    tail *= c2;
+    h ^= tail;
+
+    return fmix64(h);
+}
@@ -0,0 +1,61 @@
+#ifndef NANO_CRC_H
+#define NANO_CRC_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace nano
+{
+
+    /**
+     * Обновить CRC-16/CCITT одним байтом
+     *
+     * Совпадает с _crc_ccitt_update() из avr-libc (полином 0x8408,
+     * начальное значение 0xFFFF), которой пользуется адаптер
+     */
+    inline uint16_t crc16_update(uint16_t crc, uint8_t data)
+    {
+        data ^= crc & 0xFF;
+        data ^= data << 4;
+        return ((uint16_t(data) << 8) | (crc >> 8)) ^ uint8_t(data >> 4) ^ (uint16_t(data) << 3);
+    }
+
+    inline uint16_t crc16(const uint8_t *data, size_t size, uint16_t crc = 0xFFFF)
+    {
+        for(size_t i = 0; i < size; i++) crc = crc16_update(crc, data[i]);
+        return crc;
+    }
+
+    /**
+     * Обновить CRC-32 (полином 0xEDB88320, как в zlib) одним байтом
+     *
+     * Адаптер считает CRC-32 так же (команды isp_crc и arm_crc)
+     */
+    inline uint32_t crc32_update(uint32_t crc, uint8_t data)
+    {
+        crc ^= data;
+        for(int i = 0; i < 8; i++)
+        {
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+        }
+        return crc;
+    }
+
+    inline uint32_t crc32(const uint8_t *data, size_t size)
+    {
+        uint32_t crc = 0xFFFFFFFF;
+        for(size_t i = 0; i < size; i++) crc = crc32_update(crc, data[i]);
+        return ~crc;
+    }
+
+    /**
+     * Быстрый 64-битный хеш (не криптографический)
+     *
+     * Данные обрабатываются словами по 8 байт с перемешиванием как
+     * в MurmurHash3, для ключей кеша по содержимому больших файлов
+     */
+    uint64_t hash64(const uint8_t *data, size_t size, uint64_t seed = 0);
+
+}
+
+#endif // NANO_CRC_H
@@ -0,0 +1 @@
+#include "ringbuf.h"
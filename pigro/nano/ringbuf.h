@@ -0,0 +1,83 @@
+#ifndef NANO_RINGBUF_H
+#define NANO_RINGBUF_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace nano
+{
+
+    /**
+     * Кольцевой буфер байтов
+     *
+     * Размер всегда степень двойки, при переполнении буфер расширяется,
+     * так что запись никогда не теряет данные
+     */
+    class ringbuf
+    {
+    private:
+
+        std::vector<uint8_t> m_data;
+        size_t m_begin { 0 };
+        size_t m_size { 0 };
+
+        size_t mask() const { return m_data.size() - 1; }
+
+        void grow(size_t need)
+        {
+            size_t capacity = m_data.size();
+            while ( capacity < need ) capacity *= 2;
+            if ( capacity == m_data.size() ) return;
+
+            std::vector<uint8_t> data(capacity);
+            for(size_t i = 0; i < m_size; i++) data[i] = m_data[(m_begin + i) & mask()];
+            m_data.swap(data);
+            m_begin = 0;
+        }
+
+    public:
+
+        explicit ringbuf(size_t capacity = 1024): m_data(capacity)
+        {
+            size_t size = 1;
+            while ( size < capacity ) size *= 2;
+            m_data.resize(size);
+        }
+
+        bool empty() const { return m_size == 0; }
+        size_t size() const { return m_size; }
+        size_t capacity() const { return m_data.size(); }
+
+        bool read(uint8_t *dest)
+        {
+            if ( m_size == 0 ) return false;
+            *dest = m_data[m_begin];
+            m_begin = (m_begin + 1) & mask();
+            m_size--;
+            return true;
+        }
+
+        void write(const uint8_t *data, size_t size)
+        {
+            grow(m_size + size);
+            size_t end = (m_begin + m_size) & mask();
+            for(size_t i = 0; i < size; i++)
+            {
+                m_data[end] = data[i];
+                end = (end + 1) & mask();
+            }
+            m_size += size;
+        }
+
+        void clear()
+        {
+            m_begin = 0;
+            m_size = 0;
+        }
+
+    };
+
+}
+
+#endif // NANO_RINGBUF_H
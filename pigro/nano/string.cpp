@@ -1,6 +1,67 @@
 #include "string.h"
 
 #include <cctype>
+#include <array>
+
+/**
+ * Таблица перевода шестнадцатеричной цифры, 0x80 - не цифра
+ */
+static constexpr std::array<uint8_t, 256> make_hex_table()
+{
+    std::array<uint8_t, 256> table {};
+    for(int ch = 0; ch < 256; ch++)
+    {
+        table[ch] = 0x80;
+        if ( ch >= '0' && ch <= '9' ) table[ch] = ch - '0';
+        if ( ch >= 'A' && ch <= 'F' ) table[ch] = ch - 'A' + 10;
+        if ( ch >= 'a' && ch <= 'f' ) table[ch] = ch - 'a' + 10;
+    }
+    return table;
+}
+
+static constexpr std::array<uint8_t, 256> hex_table = make_hex_table();
+
+bool nano::decode_hex(const char *text, uint8_t *bytes, size_t count)
+{
+    // ошибки накапливаются в бите 0x80 и проверяются один раз
+    uint8_t bad = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        const uint8_t hi = hex_table[uint8_t(text[i * 2])];
+        const uint8_t lo = hex_table[uint8_t(text[i * 2 + 1])];
+        bad |= hi | lo;
+        bytes[i] = (hi << 4) | (lo & 0x0F);
+    }
+    return (bad & 0x80) == 0;
+}
+
+/**
+ * Таблица перевода байта в две шестнадцатеричные цифры
+ */
+static constexpr std::array<char, 512> make_hex_digits()
+{
+    constexpr char digits[] = "0123456789ABCDEF";
+    std::array<char, 512> table {};
+    for(int byte = 0; byte < 256; byte++)
+    {
+        table[byte * 2] = digits[byte >> 4];
+        table[byte * 2 + 1] = digits[byte & 0x0F];
+    }
+    return table;
+}
+
+static constexpr std::array<char, 512> hex_digits = make_hex_digits();
+
+char* nano::encode_hex(const uint8_t *bytes, size_t count, char *text)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        text[0] = hex_digits[bytes[i] * 2];
+        text[1] = hex_digits[bytes[i] * 2 + 1];
+        text += 2;
+    }
+    return text;
+}
 
 std::string_view nano::trim(std::string_view text)
 {
@@ -28,6 +28,24 @@ namespace nano
         throw nano::exception("wrong hex digit");
     }
 
+    /**
+     * Перевести count байт из шестнадцатеричного текста (2 цифры на байт)
+     *
+     * Без исключений и ветвлений на каждую цифру, для разбора больших
+     * файлов прошивки
+     *
+     * @return false если встретился символ, который не является цифрой
+     */
+    bool decode_hex(const char *text, uint8_t *bytes, size_t count);
+
+    /**
+     * Записать count байт шестнадцатеричным текстом (2 заглавные цифры
+     * на байт) по таблице, без sprintf
+     *
+     * @return указатель на символ после записанного текста
+     */
+    char* encode_hex(const uint8_t *bytes, size_t count, char *text);
+
     /**
      * Первести шестнадцатеричное число из строки в целочисленное значение
      */
@@ -9,16 +9,21 @@ SOURCES += \
     ARM.cpp \
     AVR.cpp \
     DeviceInfo.cpp \
+    FirmwareCache.cpp \
     FirmwareData.cpp \
+    FirmwareFile.cpp \
     FirmwareInfo.cpp \
     Pigro.cpp \
     PigroApp.cpp \
+    PigroBatch.cpp \
     PigroDriver.cpp \
     PigroLink.cpp \
     nano/config.cpp \
+    nano/crc.cpp \
     nano/ini.cpp \
     nano/map.cpp \
     nano/math.cpp \
+    nano/ringbuf.cpp \
     nano/string.cpp \
     nano/IniReader.cpp \
     nano/exception.cpp \
@@ -29,16 +34,21 @@ HEADERS += \
     ARM.h \
     AVR.h \
     DeviceInfo.h \
+    FirmwareCache.h \
     FirmwareData.h \
+    FirmwareFile.h \
     FirmwareInfo.h \
     Pigro.h \
     PigroApp.h \
+    PigroBatch.h \
     PigroDriver.h \
     PigroLink.h \
     nano/config.h \
+    nano/crc.h \
     nano/ini.h \
     nano/map.h \
     nano/math.h \
+    nano/ringbuf.h \
     nano/string.h \
     nano/IniReader.h \
     nano/exception.h \
@@ -25,6 +25,14 @@ namespace avr
             avr::ioreg(UBRRL).raw_write(rate % 256);
         }
 
+        /**
+         * Удвоение скорости (U2X), делитель считается от F_CPU/8
+         */
+        static void setDoubleSpeed(bool value)
+        {
+            avr::ioreg(UCSRA).write_pin(U2X, value);
+        }
+
         static void enable_tx_empty_isr()
         {
             avr::ioreg(UCSRB).write_pin(UDRIE, true);
@@ -2,12 +2,50 @@
 #define PIGRO_PROTO_H
 
 #include <stdint.h>
+#include <util/crc16.h>
 #include <avrxx/uart.h>
 #include <tiny/uartbuf.h>
 
 #include "PigroTimer.h"
 
-inline tiny::uartbuf<avr::UART> uart {};
+/**
+ * Размер приемного буфера UART
+ *
+ * В оконном режиме в буфере должны помещаться все пакеты, которые хост
+ * успел отправить, пока мы обрабатываем текущую команду
+ */
+constexpr uint8_t UART_RX_SIZE = 64;
+
+inline tiny::uartbuf<avr::UART, UART_RX_SIZE> uart {};
+
+// 51 at 8MHz = 9600
+//constexpr auto UART_BAUD_K = 51;
+
+// 47 at 7.3728 MHz = 9600
+constexpr auto UART_BAUD_K = 47;
+
+// 103 at 16MHz = 9600
+//constexpr auto UART_BAUD_K = 103;
+
+/**
+ * Скорости, на которые можно переключиться командой proto_config
+ *
+ * Делители для кварца 7.3728 MHz, на нем стандартные скорости получаются
+ * без ошибки (250k/500k/1M на этом кварце не получить)
+ */
+struct uart_baud_t
+{
+    uint32_t rate;
+    uint8_t k;
+    bool u2x;
+};
+
+constexpr uart_baud_t UART_BAUD_RATES[] = {
+    { 115200, 3, false },
+    { 230400, 1, false },
+    { 460800, 0, false },
+    { 921600, 0, true },
+};
 
 class PigroProto
 {
@@ -18,6 +56,33 @@ public:
     static constexpr uint8_t PKT_ACK = 1;
     static constexpr uint8_t PKT_NACK = 2;
 
+    /**
+     * Подтверждения в оконном режиме
+     *
+     * Старший бит отличает подтверждение от ответного пакета (номера команд
+     * всегда меньше 0x80), младшие 6 бит - порядковый номер пакета
+     */
+    static constexpr uint8_t PKT_WINDOW_ACK = 0x80;
+    static constexpr uint8_t PKT_WINDOW_NACK = 0xC0;
+    static constexpr uint8_t PKT_SEQ_MASK = 0x3F;
+
+    /**
+     * Максимальное число пакетов в пути
+     *
+     * Ограничено тем, сколько пакетов максимальной длины помещается в
+     * приемный буфер UART
+     */
+    static constexpr uint8_t MAX_WINDOW = (UART_RX_SIZE - 1) / (PACKET_MAXLEN + 2);
+
+    /**
+     * Маркер большого пакета (bulk frame)
+     *
+     * Формат: PKT_BULK, cmd, len (2 байта), data[len], crc16 (2 байта),
+     * CRC-16/CCITT считается по cmd, len и data
+     */
+    static constexpr uint8_t PKT_BULK = 0x7F;
+    static constexpr uint16_t BULK_MAXLEN = 256;
+
     struct packet_t
     {
         uint8_t cmd;
@@ -25,6 +90,13 @@ public:
         uint8_t data[PACKET_MAXLEN];
     };
 
+    struct bulk_t
+    {
+        uint8_t cmd;
+        uint16_t len;
+        uint8_t data[BULK_MAXLEN];
+    };
+
     class ReadTimer
     {
     public:
@@ -34,6 +106,49 @@ public:
 
     static inline packet_t pkt;
 
+    /**
+     * Буфер большого пакета
+     *
+     * Если пакет пришел как bulk frame, то pkt.cmd содержит номер команды,
+     * pkt.len = 0, а данные лежат здесь
+     */
+    static inline bulk_t bulk;
+
+    /**
+     * Текущий пакет пришел как bulk frame
+     */
+    static inline bool bulk_frame;
+
+    /**
+     * Разрешенный размер больших пакетов, 0 - не поддерживаются
+     */
+    static inline uint16_t bulk_size;
+
+    /**
+     * Выполняется пакет batch, ответы подкоманд складываются в bulk.data
+     */
+    static inline bool batch_mode;
+
+    /**
+     * Позиция, до которой буфер bulk.data уже прочитан (batch)
+     */
+    static inline uint16_t batch_in;
+
+    /**
+     * Позиция записи следующего ответа в bulk.data (batch)
+     */
+    static inline uint16_t batch_out;
+
+    /**
+     * Размер окна, 0 - режим stop-and-wait
+     */
+    static inline uint8_t window;
+
+    /**
+     * Порядковый номер следующего принятого пакета (оконный режим)
+     */
+    static inline uint8_t seq;
+
     static bool usart_read(uint8_t &dest)
     {
         while ( !uart.read(&dest) )
@@ -56,23 +171,125 @@ public:
 
     static inline bool send_ack()
     {
-        return usart_write(PKT_ACK);
+        if ( window == 0 ) return usart_write(PKT_ACK);
+        return usart_write(PKT_WINDOW_ACK | (seq++ & PKT_SEQ_MASK));
     }
 
     static inline bool send_nack()
     {
-        return usart_write(PKT_NACK);
+        if ( window == 0 ) return usart_write(PKT_NACK);
+        return usart_write(PKT_WINDOW_NACK | (seq++ & PKT_SEQ_MASK));
     }
 
-    static bool read_packet()
+    static void set_baud_rate(uint8_t k, bool u2x)
+    {
+        avr::UART::setDoubleSpeed(u2x);
+        avr::UART::setBaudRate(k);
+    }
+
+    /**
+     * Дождаться окончания передачи
+     *
+     * Буфер может опустеть раньше, чем последний байт уйдет в линию,
+     * поэтому дополнительно ждем один период таймера
+     */
+    static void uart_drain()
     {
+        while ( !uart.output_empty() ) tiny::sleep();
 
+        ReadTimer tm;
+        while ( !Timer::expire() ) tiny::sleep();
+    }
+
+    /**
+     * Включить оконный режим (0 - вернуться в stop-and-wait)
+     */
+    static void set_window(uint8_t size)
+    {
+        window = size;
+        seq = 0;
+    }
+
+    static uint16_t crc_update(uint16_t crc, uint8_t byte)
+    {
+        return _crc_ccitt_update(crc, byte);
+    }
+
+    /**
+     * Прочитать большой пакет (после маркера PKT_BULK)
+     *
+     * Большой пакет на низкой скорости читается дольше, чем срабатывает
+     * таймер, поэтому таймаут отсчитывается от последнего принятого байта
+     */
+    static bool read_bulk()
+    {
+        uint8_t lo, hi;
+        uint16_t crc = 0xFFFF;
+
+        if ( !usart_read(bulk.cmd) ) return false;
+        if ( !usart_read(lo) || !usart_read(hi) ) return false;
+        crc = crc_update(crc, bulk.cmd);
+        crc = crc_update(crc, lo);
+        crc = crc_update(crc, hi);
+
+        bulk.len = lo | (uint16_t(hi) << 8);
+        if ( bulk.len > bulk_size ) return false;
+
+        for(uint16_t i = 0; i < bulk.len; i++)
+        {
+            if ( !usart_read(bulk.data[i]) ) return false;
+            crc = crc_update(crc, bulk.data[i]);
+            Timer::reset();
+        }
+
+        if ( !usart_read(lo) || !usart_read(hi) ) return false;
+        if ( crc != (lo | (uint16_t(hi) << 8)) ) return false;
+
+        pkt.cmd = bulk.cmd;
+        pkt.len = 0;
+        bulk_frame = true;
+        return true;
+    }
+
+    /**
+     * Прочитать первый байт пакета с таймаутом
+     *
+     * @param periods сколько периодов таймера ждать
+     */
+    static bool read_head(uint8_t periods)
+    {
+        ReadTimer tm;
+        while ( !uart.read(&pkt.cmd) )
+        {
+            if ( Timer::expire() )
+            {
+                if ( --periods == 0 ) return false;
+                Timer::reset();
+            }
+            tiny::sleep();
+        }
+        return true;
+    }
+
+    static bool read_packet()
+    {
         // первый пакет читаем без таймаута
         uart.read_sync(&pkt.cmd);
 
+        return read_tail();
+    }
+
+    /**
+     * Прочитать остаток пакета (первый байт уже прочитан в pkt.cmd)
+     */
+    static bool read_tail()
+    {
         // для последующих байт задаем таймаут
         ReadTimer tm;
 
+        bulk_frame = false;
+        if ( pkt.cmd == PKT_BULK ) return read_bulk();
+
         if ( ! usart_read(pkt.len) ) return false;
 
         if ( pkt.len > PACKET_MAXLEN ) return false;
@@ -85,8 +302,27 @@ public:
         return true;
     }
 
+    /**
+     * Сохранить ответ подкоманды batch
+     *
+     * Ответ пишется поверх уже выполненных подкоманд, он не должен
+     * залезать на еще не прочитанные
+     */
+    static void batch_reply()
+    {
+        if ( batch_out + 2 + pkt.len > batch_in ) return;
+        bulk.data[batch_out++] = pkt.cmd;
+        bulk.data[batch_out++] = pkt.len;
+        for(uint8_t i = 0; i < pkt.len; i++)
+        {
+            bulk.data[batch_out++] = pkt.data[i];
+        }
+    }
+
     static void send_packet()
     {
+        if ( batch_mode ) return batch_reply();
+
         if ( !usart_write(pkt.cmd) ) return;
         if ( !usart_write(pkt.len) ) return;
         for(uint8_t i = 0; i < pkt.len; i++)
@@ -96,6 +332,30 @@ public:
         return;
     }
 
+    static bool write_crc(uint8_t byte, uint16_t &crc)
+    {
+        crc = crc_update(crc, byte);
+        return usart_write(byte);
+    }
+
+    /**
+     * Отправить большой пакет из буфера bulk
+     */
+    static void send_bulk()
+    {
+        uint16_t crc = 0xFFFF;
+        if ( !usart_write(PKT_BULK) ) return;
+        if ( !write_crc(bulk.cmd, crc) ) return;
+        if ( !write_crc(bulk.len & 0xFF, crc) ) return;
+        if ( !write_crc(bulk.len >> 8, crc) ) return;
+        for(uint16_t i = 0; i < bulk.len; i++)
+        {
+            if ( !write_crc(bulk.data[i], crc) ) return;
+        }
+        if ( !usart_write(crc & 0xFF) ) return;
+        if ( !usart_write(crc >> 8) ) return;
+    }
+
     /**
      * Прочитать мусор после рассинхрона
      */
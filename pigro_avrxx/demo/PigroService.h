@@ -12,7 +12,7 @@ class PigroService: public PigroProto
 {
 public:
 
-    static constexpr uint8_t PROTO_VERSION = 0;
+    static constexpr uint8_t PROTO_VERSION = 1;
     static constexpr uint8_t SERVICE_VERSION = 1;
 
     /**
@@ -29,6 +29,14 @@ public:
         }
     }
 
+    /**
+     * Текущий Extended Address Byte чипа (команда 0x4D), после сброса 0
+     *
+     * Нужен чипам с флеш больше 128 КБ, адаптер подает 0x4D только
+     * если байт меняется
+     */
+    static inline uint8_t isp_ext_addr;
+
     /**
      * Обработка команды isp_reset
      */
@@ -37,9 +45,29 @@ public:
         if ( pkt.len == 1 )
         {
             avr::pin(PORTB, PB1).set(pkt.data[0]);
+            isp_ext_addr = 0;
         }
     }
 
+    /**
+     * Запомнить Extended Address Byte, если хост сам подает 0x4D
+     */
+    static void isp_snoop_ext_addr(const uint8_t *io)
+    {
+        if ( io[0] == 0x4D ) isp_ext_addr = io[2];
+    }
+
+    /**
+     * Подать "Load Extended Address Byte", если байт изменился
+     */
+    static void isp_extended_address(uint8_t ext)
+    {
+        if ( ext == isp_ext_addr ) return;
+        uint8_t io[4] = { 0x4D, 0x00, ext, 0x00 };
+        spi.ioctl(io, 4);
+        isp_ext_addr = ext;
+    }
+
     /**
      * Обработка команды isp_io
      */
@@ -47,11 +75,420 @@ public:
     {
         if ( pkt.len == 4 )
         {
+            isp_snoop_ext_addr(pkt.data);
             spi.ioctl(pkt.data, 4);
             send_packet();
         }
     }
 
+    /**
+     * Частота SCK: 0 - fosc/128 (по умолчанию), ... 6 - fosc/2
+     */
+    static constexpr uint8_t ISP_CLOCK_MAX = 6;
+
+    static inline uint8_t isp_clock;
+
+    /**
+     * Установить делитель SPI
+     *
+     * Делитель fosc/(128 >> index) задается битами SPR1:SPR0 в SPCR
+     * и битом SPI2X в SPSR
+     */
+    static void isp_set_clock(uint8_t index)
+    {
+        uint8_t spr = 3;
+        bool x2 = false;
+        if ( index > 0 )
+        {
+            spr = 2 - (index - 1) / 2;
+            x2 = (index - 1) & 1;
+        }
+
+        SPCR = (SPCR & ~tiny::makebits(SPR1, SPR0)) | spr;
+        SPSR = x2 ? tiny::makebits(SPI2X) : 0;
+        isp_clock = index;
+    }
+
+    /**
+     * Обработка команды isp_clock
+     *
+     * data[0] - индекс частоты SCK (0..ISP_CLOCK_MAX), без данных
+     * только узнать текущую частоту.
+     *
+     * Ответ: индекс установленной частоты
+     */
+    static void cmd_isp_clock()
+    {
+        if ( pkt.len > 1 ) return;
+        if ( pkt.len == 1 && pkt.data[0] <= ISP_CLOCK_MAX ) isp_set_clock(pkt.data[0]);
+
+        pkt.len = 1;
+        pkt.data[0] = isp_clock;
+        send_packet();
+    }
+
+    /**
+     * Статус команды isp_load_page
+     */
+    enum isp_status_t: uint8_t
+    {
+        ISP_OK = 0,
+        ISP_LOAD_FAIL = 1,
+        ISP_WRITE_FAIL = 2,
+        ISP_BUSY_TIMEOUT = 3
+    };
+
+    static constexpr uint8_t ISP_PAGE_WRITE = 1;
+    static constexpr uint8_t ISP_PAGE_WAIT = 2;
+    static constexpr uint8_t ISP_PAGE_EEPROM = 4;
+
+    /**
+     * Память для isp_read_block и isp_crc (необязательный последний байт)
+     */
+    static constexpr uint8_t ISP_MEMORY_FLASH = 0;
+    static constexpr uint8_t ISP_MEMORY_EEPROM = 1;
+
+    /**
+     * Команда "Write Program Memory Page"
+     */
+    static bool isp_write_page(uint16_t word_addr)
+    {
+        uint8_t io[4] = { 0x4C, uint8_t(word_addr >> 8), uint8_t(word_addr & 0xFF), 0 };
+        spi.ioctl(io, 4);
+        return io[1] == 0x4C;
+    }
+
+    /**
+     * Команда "Write EEPROM Memory Page"
+     */
+    static bool isp_write_eeprom_page(uint16_t addr)
+    {
+        uint8_t io[4] = { 0xC2, uint8_t(addr >> 8), uint8_t(addr & 0xFF), 0 };
+        spi.ioctl(io, 4);
+        return io[1] == 0xC2;
+    }
+
+    /**
+     * Сколько периодов таймера ждать окончания записи страницы
+     * в isp_load_page (~43 мс, с большим запасом)
+     */
+    static constexpr uint16_t ISP_PAGE_TIMEOUT = 160;
+
+    /**
+     * Сколько периодов таймера прошло с начала ожидания
+     *
+     * Счетчик таймера 8-битный, поэтому периодически переносим его
+     * в elapsed
+     */
+    static uint16_t elapsed_ticks(uint16_t &elapsed)
+    {
+        const uint8_t ticks = Timer::ticks();
+        if ( ticks >= 200 )
+        {
+            Timer::reset();
+            elapsed += ticks;
+            return elapsed;
+        }
+        return elapsed + ticks;
+    }
+
+    /**
+     * Пауза на заданное число периодов таймера (~272 мкс)
+     */
+    static void wait_ticks(uint16_t ticks)
+    {
+        ReadTimer tm;
+        uint16_t elapsed = 0;
+        while ( elapsed_ticks(elapsed) < ticks ) tiny::sleep();
+    }
+
+    /**
+     * Дождаться готовности чипа командой "Poll RDY/BSY"
+     *
+     * @return false если чип не освободился за timeout периодов таймера
+     */
+    static bool isp_wait_ready(uint16_t timeout)
+    {
+        ReadTimer tm;
+        uint16_t elapsed = 0;
+        while ( true )
+        {
+            uint8_t io[4] = { 0xF0, 0, 0, 0 };
+            spi.ioctl(io, 4);
+            if ( (io[3] & 1) == 0 ) return true;
+            if ( elapsed_ticks(elapsed) >= timeout ) return false;
+        }
+    }
+
+    static constexpr uint8_t ISP_WAIT_DELAY = 0;
+    static constexpr uint8_t ISP_WAIT_POLL = 1;
+
+    /**
+     * Обработка команды isp_io_wait
+     *
+     * Выполнить команду программирования и дождаться ее завершения:
+     * data[0..3] - команда, data[4] - способ ожидания (ISP_WAIT_DELAY -
+     * просто выждать, ISP_WAIT_POLL - опрашивать RDY/BSY), data[5..6] -
+     * задержка или таймаут в периодах таймера.
+     *
+     * Ответ: ответ чипа на команду (4 байта) и статус (isp_status_t)
+     */
+    static void cmd_isp_io_wait()
+    {
+        if ( pkt.len != 7 ) return;
+
+        const uint8_t mode = pkt.data[4];
+        const uint16_t ticks = pkt.data[5] | (uint16_t(pkt.data[6]) << 8);
+
+        isp_snoop_ext_addr(pkt.data);
+        spi.ioctl(pkt.data, 4);
+
+        uint8_t status = ISP_OK;
+        if ( mode == ISP_WAIT_POLL )
+        {
+            if ( !isp_wait_ready(ticks) ) status = ISP_BUSY_TIMEOUT;
+        }
+        else
+        {
+            wait_ticks(ticks);
+        }
+
+        pkt.len = 5;
+        pkt.data[4] = status;
+        send_packet();
+    }
+
+    /**
+     * Обработка команды isp_load_page
+     *
+     * data[0] - флаги (ISP_PAGE_WRITE - записать страницу командой 0x4C,
+     * ISP_PAGE_WAIT - дождаться окончания записи по RDY/BSY,
+     * ISP_PAGE_EEPROM - страница EEPROM),
+     * data[1..2] - адрес слова, с которого начинается блок, далее байты
+     * прошивки. Команды 0x40/0x48 для каждого байта адаптер формирует сам.
+     * Старший байт адреса (0x4D) хост подает заранее командой isp_io.
+     *
+     * Для EEPROM data[1..2] - байтовый адрес, байты загружаются командой
+     * 0xC1, страница записывается командой 0xC2
+     *
+     * Ответ: статус (isp_status_t) и смещение байта, на котором
+     * произошла ошибка (2 байта)
+     */
+    static void cmd_isp_load_page()
+    {
+        const uint8_t *data = bulk_frame ? bulk.data : pkt.data;
+        const uint16_t len = bulk_frame ? bulk.len : pkt.len;
+        if ( len < 3 ) return;
+
+        const uint8_t flags = data[0];
+        const uint16_t word_addr = data[1] | (uint16_t(data[2]) << 8);
+        const uint16_t size = len - 3;
+
+        const bool eeprom = flags & ISP_PAGE_EEPROM;
+
+        uint8_t status = ISP_OK;
+        uint16_t offset = 0;
+        for(; offset < size; offset++)
+        {
+            const uint16_t addr = eeprom ? (word_addr + offset) : (word_addr + (offset >> 1));
+            const uint8_t op = eeprom ? 0xC1 : ((offset & 1) ? 0x48 : 0x40);
+            uint8_t io[4] = { op, uint8_t(eeprom ? 0 : (addr >> 8)), uint8_t(addr & 0xFF), data[3 + offset] };
+            spi.ioctl(io, 4);
+            if ( io[1] != op )
+            {
+                status = ISP_LOAD_FAIL;
+                break;
+            }
+        }
+
+        if ( status == ISP_OK && (flags & ISP_PAGE_WRITE) )
+        {
+            const bool written = eeprom ? isp_write_eeprom_page(word_addr) : isp_write_page(word_addr);
+            if ( !written ) status = ISP_WRITE_FAIL;
+            else if ( (flags & ISP_PAGE_WAIT) && !isp_wait_ready(ISP_PAGE_TIMEOUT) ) status = ISP_BUSY_TIMEOUT;
+        }
+
+        pkt.len = 3;
+        pkt.data[0] = status;
+        pkt.data[1] = offset & 0xFF;
+        pkt.data[2] = offset >> 8;
+        send_packet();
+    }
+
+    /**
+     * Дождаться окончания записи байта опросом (data polling)
+     *
+     * Пока идет запись, чтение байта возвращает readback (0xFF или 0x7F),
+     * после записи - записанное значение
+     *
+     * @return false если за timeout периодов таймера значение не появилось
+     */
+    static bool isp_poll_byte(uint16_t addr, uint8_t value, uint16_t timeout)
+    {
+        ReadTimer tm;
+        uint16_t elapsed = 0;
+        while ( true )
+        {
+            if ( isp_read_byte(addr, false) == value ) return true;
+            if ( elapsed_ticks(elapsed) >= timeout ) return false;
+        }
+    }
+
+    /**
+     * Обработка команды isp_write_bytes
+     *
+     * Побайтовая запись флеш старых чипов без страничной записи (AT90S,
+     * ATtiny1x): data[0..1] - байтовый адрес, data[2] - readback (что
+     * читается во время записи), data[3] - время записи байта в периодах
+     * таймера, далее байты прошивки.
+     *
+     * Каждый байт пишется командой 0x40/0x48, окончание записи адаптер
+     * определяет опросом. Если байт совпадает с readback, то опрос
+     * невозможен и адаптер просто выжидает время записи. Байты 0xFF
+     * пропускаются - после стирания чипа они и так 0xFF
+     *
+     * Ответ: статус (isp_status_t) и смещение байта, на котором
+     * произошла ошибка (2 байта)
+     */
+    static void cmd_isp_write_bytes()
+    {
+        const uint8_t *data = bulk_frame ? bulk.data : pkt.data;
+        const uint16_t len = bulk_frame ? bulk.len : pkt.len;
+        if ( len < 4 ) return;
+
+        const uint16_t base = data[0] | (uint16_t(data[1]) << 8);
+        const uint8_t readback = data[2];
+        const uint8_t delay = data[3];
+        const uint16_t timeout = uint16_t(delay) * 4;
+        const uint16_t size = len - 4;
+
+        uint8_t status = ISP_OK;
+        uint16_t offset = 0;
+        for(; offset < size; offset++)
+        {
+            const uint8_t value = data[4 + offset];
+            if ( value == 0xFF ) continue;
+
+            const uint16_t addr = base + offset;
+            const uint16_t word_addr = addr >> 1;
+            uint8_t io[4] = { uint8_t((addr & 1) ? 0x48 : 0x40), uint8_t(word_addr >> 8), uint8_t(word_addr & 0xFF), value };
+            spi.ioctl(io, 4);
+
+            if ( value == readback )
+            {
+                wait_ticks(delay);
+            }
+            else if ( !isp_poll_byte(addr, value, timeout) )
+            {
+                status = ISP_BUSY_TIMEOUT;
+                break;
+            }
+        }
+
+        pkt.len = 3;
+        pkt.data[0] = status;
+        pkt.data[1] = offset & 0xFF;
+        pkt.data[2] = offset >> 8;
+        send_packet();
+    }
+
+    /**
+     * Обработка команды isp_read_block
+     *
+     * data[0..2] - байтовый адрес, data[3..4] - число байт, data[5] -
+     * память (необязательно, ISP_MEMORY_FLASH по умолчанию). Байты читаются
+     * командами 0x20/0x28 (EEPROM - 0xA0) и отправляются большими пакетами
+     * по bulk_size байт, пока не будет отправлено все запрошенное
+     */
+    static void cmd_isp_read_block()
+    {
+        if ( (pkt.len != 5 && pkt.len != 6) || bulk_size == 0 ) return;
+
+        uint32_t addr = pkt.data[0] | (uint16_t(pkt.data[1]) << 8) | (uint32_t(pkt.data[2]) << 16);
+        uint16_t count = pkt.data[3] | (uint16_t(pkt.data[4]) << 8);
+        const bool eeprom = pkt.len == 6 && pkt.data[5] == ISP_MEMORY_EEPROM;
+
+        bulk.cmd = 20;
+        while ( count > 0 )
+        {
+            const uint16_t n = (count < bulk_size) ? count : bulk_size;
+            for(uint16_t i = 0; i < n; i++, addr++)
+            {
+                bulk.data[i] = isp_read_byte(addr, eeprom);
+            }
+            bulk.len = n;
+            send_bulk();
+            count -= n;
+        }
+    }
+
+    /**
+     * Прочитать байт флеш-памяти командой 0x20/0x28 или EEPROM командой 0xA0
+     */
+    static uint8_t isp_read_byte(uint32_t addr, bool eeprom)
+    {
+        if ( eeprom )
+        {
+            uint8_t io[4] = { 0xA0, uint8_t(addr >> 8), uint8_t(addr & 0xFF), 0 };
+            spi.ioctl(io, 4);
+            return io[3];
+        }
+
+        const uint32_t word_addr = addr >> 1;
+        isp_extended_address(word_addr >> 16);
+
+        uint8_t io[4] = { uint8_t((addr & 1) ? 0x28 : 0x20), uint8_t(word_addr >> 8), uint8_t(word_addr & 0xFF), 0 };
+        spi.ioctl(io, 4);
+        return io[3];
+    }
+
+    /**
+     * Обновить CRC-32 (полином 0xEDB88320, как в zlib) одним байтом
+     */
+    static uint32_t crc32_update(uint32_t crc, uint8_t byte)
+    {
+        crc ^= byte;
+        for(uint8_t i = 0; i < 8; i++)
+        {
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+        }
+        return crc;
+    }
+
+    static void send_crc32(uint32_t crc)
+    {
+        crc = ~crc;
+        pkt.len = 4;
+        pkt.data[0] = crc & 0xFF;
+        pkt.data[1] = (crc >> 8) & 0xFF;
+        pkt.data[2] = (crc >> 16) & 0xFF;
+        pkt.data[3] = crc >> 24;
+        send_packet();
+    }
+
+    /**
+     * Обработка команды isp_crc
+     *
+     * data[0..2] - байтовый адрес, data[3..4] - число байт, data[5] -
+     * память (как в isp_read_block). Адаптер сам читает память и
+     * возвращает CRC-32 прочитанного (4 байта)
+     */
+    static void cmd_isp_crc()
+    {
+        if ( pkt.len != 5 && pkt.len != 6 ) return;
+
+        uint32_t addr = pkt.data[0] | (uint16_t(pkt.data[1]) << 8) | (uint32_t(pkt.data[2]) << 16);
+        uint16_t count = pkt.data[3] | (uint16_t(pkt.data[4]) << 8);
+        const bool eeprom = pkt.len == 6 && pkt.data[5] == ISP_MEMORY_EEPROM;
+
+        uint32_t crc = 0xFFFFFFFF;
+        for(; count > 0; count--, addr++)
+        {
+            crc = crc32_update(crc, isp_read_byte(addr, eeprom));
+        }
+        send_crc32(crc);
+    }
+
     static void cmd_jtag_test()
     {
         if ( pkt.len == 1 )
@@ -119,7 +556,7 @@ public:
     {
         if ( pkt.len == 2 && pkt.data[0] == 1 )
         {
-            STM32::memap = pkt.data[1];
+            STM32::set_memap(pkt.data[1]);
             return send_packet();
         }
 
@@ -128,6 +565,13 @@ public:
             STM32::mem_addr = *reinterpret_cast<uint32_t*>(&pkt.data[1]);
             return send_packet();
         }
+
+        // транспорт: 0 - JTAG, 1 - SWD, в ответ 0xFF если SWD-DP не отвечает
+        if ( pkt.len == 2 && pkt.data[0] == 3 )
+        {
+            if ( !STM32::set_transport(pkt.data[1] == 1) ) pkt.data[1] = 0xFF;
+            return send_packet();
+        }
     }
 
     static void cmd_arm_read_next()
@@ -238,6 +682,260 @@ public:
         }
     }
 
+    /**
+     * Обработка команды arm_read_block
+     *
+     * data[0..1] - число 32-битных слов. Слова читаются с адреса mem_addr
+     * с автоинкрементом MEM-AP и отправляются большими пакетами, mem_addr
+     * сдвигается на прочитанный блок. При ошибке отправляется пакет
+     * из одного байта с кодом ошибки, и чтение прекращается
+     */
+    static void cmd_arm_read_block()
+    {
+        if ( pkt.len != 2 || bulk_size < 4 ) return;
+
+        uint16_t count = pkt.data[0] | (uint16_t(pkt.data[1]) << 8);
+        const uint16_t frame_words = bulk_size / 4;
+        bool first = true;
+
+        bulk.cmd = 22;
+        while ( count > 0 )
+        {
+            const uint16_t n = (count < frame_words) ? count : frame_words;
+            auto error = STM32::read_block32(STM32::mem_addr, reinterpret_cast<uint32_t*>(bulk.data), n, first);
+            first = false;
+            if ( error )
+            {
+                bulk.len = 1;
+                bulk.data[0] = error;
+                send_bulk();
+                return;
+            }
+            bulk.len = n * 4;
+            send_bulk();
+            count -= n;
+        }
+    }
+
+    /**
+     * Обработка команды arm_crc
+     *
+     * data[0..1] - число 32-битных слов. Слова читаются с адреса mem_addr
+     * (как в arm_read_block), в ответ CRC-32 байтов в порядке адресов
+     * (4 байта) или код ошибки (1 байт)
+     */
+    static void cmd_arm_crc()
+    {
+        if ( pkt.len != 2 ) return;
+
+        uint16_t count = pkt.data[0] | (uint16_t(pkt.data[1]) << 8);
+        uint32_t words[16];
+        bool first = true;
+
+        uint32_t crc = 0xFFFFFFFF;
+        while ( count > 0 )
+        {
+            const uint8_t n = (count < 16) ? count : 16;
+            auto error = STM32::read_block32(STM32::mem_addr, words, n, first);
+            first = false;
+            if ( error ) return send_error(error);
+
+            const uint8_t *bytes = reinterpret_cast<const uint8_t*>(words);
+            for(uint8_t i = 0; i < n * 4; i++) crc = crc32_update(crc, bytes[i]);
+            count -= n;
+        }
+        send_crc32(crc);
+    }
+
+    /**
+     * Обработка команды arm_write_block
+     *
+     * Данные (обычный или большой пакет) - 32-битные слова, записываются
+     * с адреса mem_addr с автоинкрементом MEM-AP, mem_addr сдвигается
+     * на записанный блок. Ответ: код ошибки (0 - успешно)
+     */
+    static void cmd_arm_write_block()
+    {
+        const uint8_t *data = bulk_frame ? bulk.data : pkt.data;
+        const uint16_t len = bulk_frame ? bulk.len : pkt.len;
+        if ( len == 0 || (len % 4) != 0 ) return;
+
+        auto error = STM32::write_block32(STM32::mem_addr, reinterpret_cast<const uint32_t*>(data), len / 4);
+        send_error(error);
+    }
+
+    /**
+     * Обработка команды proto_config
+     *
+     * data[0] - параметр, остальное - значение, в ответ возвращается
+     * принятое значение. Новые параметры вступают в силу после отправки
+     * ответа.
+     *
+     * Параметры:
+     *   1 - размер окна (0 или 1 - режим stop-and-wait)
+     *   2 - максимальный размер большого пакета (2 байта, 0 - запретить)
+     *   3 - скорость UART (4 байта, в ответ 0 если скорость не поддерживается)
+     *   4 - эхо (1 байт), проверка связи после смены скорости
+     *   5 - подтверждение новой скорости (1 байт, эхо)
+     */
+    static void cmd_proto_config()
+    {
+        if ( pkt.len == 2 && pkt.data[0] == 1 )
+        {
+            const uint8_t size = (pkt.data[1] > MAX_WINDOW) ? MAX_WINDOW : pkt.data[1];
+            pkt.data[1] = (size > 1) ? size : 0;
+            send_packet();
+            set_window(pkt.data[1]);
+            return;
+        }
+
+        if ( pkt.len == 3 && pkt.data[0] == 2 )
+        {
+            const uint16_t size = pkt.data[1] | (uint16_t(pkt.data[2]) << 8);
+            bulk_size = (size > BULK_MAXLEN) ? BULK_MAXLEN : size;
+            pkt.data[1] = bulk_size & 0xFF;
+            pkt.data[2] = bulk_size >> 8;
+            return send_packet();
+        }
+
+        if ( pkt.len == 5 && pkt.data[0] == 3 )
+        {
+            return switch_baud_rate();
+        }
+
+        if ( pkt.len == 2 && (pkt.data[0] == 4 || pkt.data[0] == 5) )
+        {
+            return send_packet();
+        }
+    }
+
+    /**
+     * Сколько периодов таймера ждать проверочный пакет на новой скорости
+     */
+    static constexpr uint8_t BAUD_PROBE_PERIODS = 12;
+
+    /**
+     * Пакет подтверждения новой скорости (proto_config, параметр 5)
+     */
+    static bool baud_confirm()
+    {
+        return !bulk_frame && pkt.cmd == 17 && pkt.len == 2 && pkt.data[0] == 5;
+    }
+
+    /**
+     * Переключить скорость UART
+     *
+     * Ответ отправляется на старой скорости, после чего хост проверяет
+     * связь на новой скорости (эхо) и присылает подтверждение. Пока
+     * подтверждение не пришло, каждый следующий пакет должен прийти
+     * в течение BAUD_PROBE_PERIODS, иначе (и на любом битом пакете)
+     * возвращаемся на скорость по умолчанию. Если хост не получил
+     * ответ на эхо, он повторяет его, а не уходит на 9600, поэтому
+     * без подтверждения обе стороны не могут разойтись.
+     */
+    static void switch_baud_rate()
+    {
+        const uint32_t rate = *reinterpret_cast<uint32_t*>(&pkt.data[1]);
+        const uart_baud_t *baud = nullptr;
+        for(const auto &b : UART_BAUD_RATES)
+        {
+            if ( b.rate == rate ) baud = &b;
+        }
+
+        if ( baud == nullptr )
+        {
+            *reinterpret_cast<uint32_t*>(&pkt.data[1]) = 0;
+            return send_packet();
+        }
+
+        send_packet();
+        uart_drain();
+        set_baud_rate(baud->k, baud->u2x);
+
+        while ( read_head(BAUD_PROBE_PERIODS) && read_tail() )
+        {
+            send_ack();
+            const bool confirm = baud_confirm();
+            handle_packet();
+            if ( confirm ) return;
+        }
+
+        set_baud_rate(UART_BAUD_K, false);
+        uart.clear();
+    }
+
+    /**
+     * Подкоманда batch: пауза, data[0] - число периодов таймера (~272 мкс)
+     */
+    static constexpr uint8_t BATCH_PAUSE = 0;
+
+    /**
+     * Команды, которые можно выполнять внутри пакета batch
+     *
+     * Ответ каждой из них не длиннее запроса, поэтому ответы пишутся
+     * в тот же буфер поверх уже выполненных подкоманд
+     */
+    static bool batchable(uint8_t cmd)
+    {
+        switch ( cmd )
+        {
+        case BATCH_PAUSE:
+        case 2: // isp_reset
+        case 3: // isp_io
+        case 6: // jtag_raw_ir
+        case 7: // jtag_raw_dr
+        case 8: // arm_raw_io
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Обработка команды batch
+     *
+     * Приходит только большим пакетом: последовательность подкоманд
+     * в формате cmd, len, data[len]. Подкоманды выполняются подряд,
+     * ответы (для тех, что отвечают) возвращаются одним большим пакетом
+     * в том же формате. На первой некорректной подкоманде выполнение
+     * прекращается.
+     */
+    static void cmd_batch()
+    {
+        if ( !bulk_frame ) return;
+
+        const uint16_t len = bulk.len;
+        batch_in = 0;
+        batch_out = 0;
+        batch_mode = true;
+
+        while ( batch_in + 2 <= len )
+        {
+            pkt.cmd = bulk.data[batch_in];
+            pkt.len = bulk.data[batch_in + 1];
+            if ( !batchable(pkt.cmd) || pkt.len > PACKET_MAXLEN ) break;
+            if ( batch_in + 2 + pkt.len > len ) break;
+
+            for(uint8_t i = 0; i < pkt.len; i++)
+            {
+                pkt.data[i] = bulk.data[batch_in + 2 + i];
+            }
+            batch_in += 2 + pkt.len;
+
+            if ( pkt.cmd == BATCH_PAUSE )
+            {
+                if ( pkt.len == 1 ) wait_ticks(pkt.data[0]);
+                continue;
+            }
+
+            handle_packet();
+        }
+
+        batch_mode = false;
+        bulk.cmd = 18;
+        bulk.len = batch_out;
+        send_bulk();
+    }
+
     /**
      * Обработка команд
      */
@@ -293,6 +991,39 @@ public:
         case 16:
             cmd_arm_write();
             return;
+        case 17:
+            cmd_proto_config();
+            return;
+        case 18:
+            cmd_batch();
+            return;
+        case 19:
+            cmd_isp_load_page();
+            return;
+        case 20:
+            cmd_isp_read_block();
+            return;
+        case 21:
+            cmd_isp_io_wait();
+            return;
+        case 22:
+            cmd_arm_read_block();
+            return;
+        case 23:
+            cmd_arm_write_block();
+            return;
+        case 24:
+            cmd_isp_crc();
+            return;
+        case 25:
+            cmd_arm_crc();
+            return;
+        case 26:
+            cmd_isp_clock();
+            return;
+        case 27:
+            cmd_isp_write_bytes();
+            return;
         }
     }
 
@@ -302,6 +1033,14 @@ public:
         {
             if ( read_packet() )
             {
+                // новая сессия всегда начинается в режиме stop-and-wait
+                // и без больших пакетов
+                if ( pkt.cmd == 1 )
+                {
+                    set_window(0);
+                    bulk_size = 0;
+                }
+
                 send_ack();
                 handle_packet();
             }
@@ -309,6 +1048,9 @@ public:
             {
                 send_nack();
                 skip_trash();
+
+                // после рассинхрона хост все равно прервет сессию
+                set_window(0);
             }
         }
     }
@@ -37,6 +37,14 @@ public:
         count = 0;
     }
 
+    /**
+     * Сколько периодов прошло с последнего start() или reset()
+     */
+    static uint8_t ticks()
+    {
+        return count;
+    }
+
     static void stop()
     {
         avr::pin(TIMSK, OCIE0).set(false);
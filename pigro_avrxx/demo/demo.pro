@@ -8,6 +8,7 @@ HEADERS += \
     PigroService.h \
     PigroTimer.h \
     jtag.h \
+    swd.h \
     stm32.h
 
 SOURCES += \
@@ -3,15 +3,6 @@
 
 #include "PigroService.h"
 
-// 51 at 8MHz = 9600
-//constexpr auto UART_BAUD_K = 51;
-
-// 47 at 7.3728 MHz = 9600
-constexpr auto UART_BAUD_K = 47;
-
-// 103 at 16MHz = 9600
-//constexpr auto UART_BAUD_K = 103;
-
 /**
  * Прерываение SPI
  */
@@ -47,7 +38,10 @@ int main()
     // Инициализация SPI в режиме мастера
     // PB1 управляет RESET-ом прошиваемого контроллера
     DDRB = tiny::makebits(MOSI_BIT, PB7, SS_BIT, PB1);
-    SPCR = tiny::makebits(SPIE, SPE, MSTR, SPI2X, SPR1, SPR0);
+    // SCK начинается с fosc/128, хост может поднять частоту командой
+    // isp_clock (SPI2X находится в SPSR, а не в SPCR)
+    SPCR = tiny::makebits(SPIE, SPE, MSTR);
+    PigroService::isp_set_clock(0);
 
     DDRA = tiny::makebits(PA0, PA1, PA2, PA3, PA4, /*PA5,*/ PA6, PA7);
     PORTA = JTAG_DEFAULT_STATE;
@@ -59,7 +53,7 @@ int main()
 
     // Настройка UART
     avr::UART::init();
-    avr::UART::setBaudRate(UART_BAUD_K);
+    PigroProto::set_baud_rate(UART_BAUD_K, false);
 
     tiny::interrupt_enable();
 
@@ -2,8 +2,9 @@
 #define PIGRO_STM32_H
 
 #include "jtag.h"
+#include "swd.h"
 
-class STM32: public JTAG
+class STM32: public JTAG, public SWD
 {
 public:
 
@@ -22,8 +23,46 @@ public:
     static inline uint8_t memap;
     static inline uint32_t mem_addr;
 
+    /**
+     * Transport: false - JTAG, true - SWD
+     *
+     * DP/AP accesses go through xpacc_io(), which selects the transport,
+     * so everything above it works the same way for both
+     */
+    static inline bool swd_mode = false;
+
     static constexpr uint32_t default_csw = 0x22000000;
 
+    /**
+     * Cached state of the debug port, used to skip redundant scans
+     *
+     * current_ir - IR of STM32 TAP (ir_unknown - not known)
+     * current_select - DP SELECT register (select_unknown - not known)
+     * current_csw - MEM-AP CSW register (0 - not known)
+     */
+    static constexpr uint8_t ir_unknown = 0xFF;
+    static constexpr uint32_t select_unknown = 0xFFFFFFFF;
+
+    static inline uint8_t current_ir = ir_unknown;
+    static inline uint32_t current_select = select_unknown;
+    static inline uint32_t current_csw = 0;
+
+    /**
+     * Forget cached state, next access will set IR/SELECT/CSW again
+     */
+    static void invalidate_cache()
+    {
+        current_ir = ir_unknown;
+        current_select = select_unknown;
+        current_csw = 0;
+    }
+
+    static void set_memap(uint8_t ap)
+    {
+        memap = ap;
+        current_csw = 0;
+    }
+
     /**
      * Error code
      *
@@ -36,7 +75,7 @@ public:
      *   ... other is a fault (reserved codes)
      *
      * 0x00 - success
-     * 0x1X - I/O failure (unexpected reply from shift-ir)
+     * 0x1X - I/O failure (unexpected reply from shift-ir, no reply or parity error in SWD)
      * 0x2X - command failure (CTRL/STAT reports some sticky flags)
      * 0x4X - select failure (write to SELECT register)
      */
@@ -47,19 +86,73 @@ public:
      */
     static inline void reset_target(bool value)
     {
+        invalidate_cache();
         JD_RESET.set(value);
     }
 
+    /**
+     * Reset the debug port to JTAG
+     *
+     * The target may still be in SWD (left by an earlier session even if
+     * the adapter was restarted since), so the SWD-to-JTAG sequence is
+     * always sent. For a target already in JTAG it only walks the TAP
+     * through Test-Logic-Reset
+     */
     static inline void init_jtag()
     {
+        invalidate_cache();
+        swd_mode = false;
+        SWD::switch_to_jtag();
         JTAG::init();
     }
 
+    /**
+     * Select transport (JTAG or SWD)
+     *
+     * Switching to SWD sends the JTAG-to-SWD sequence, reads DPIDR
+     * (required to leave the line reset state) and clears sticky errors.
+     * A FAULT on DPIDR means stale sticky flags: they are cleared through
+     * ABORT and DPIDR is read again, only an OK reply counts
+     *
+     * @return false if SWD-DP does not respond
+     */
+    static bool set_transport(bool swd)
+    {
+        invalidate_cache();
+        if ( swd == swd_mode ) return true;
+
+        swd_mode = swd;
+        if ( !swd )
+        {
+            SWD::switch_to_jtag();
+            JTAG::init();
+            return true;
+        }
+
+        SWD::switch_to_swd();
+        uint32_t idcode = 0;
+        uint8_t ack = SWD::transfer(false, request_read(0x0), &idcode);
+        if ( ack == SWD_ACK_FAULT )
+        {
+            clear_sticky(0);
+            ack = SWD::transfer(false, request_read(0x0), &idcode);
+        }
+        if ( ack != SWD_ACK_OK )
+        {
+            swd_mode = false;
+            JTAG::init();
+            return false;
+        }
+        clear_sticky(0);
+        return true;
+    }
+
     /**
      * Reset JTAG-SM state
      */
     static inline void reset_jtag_state()
     {
+        invalidate_cache();
         JTAG::reset();
     }
 
@@ -70,6 +163,7 @@ public:
      */
     static void raw_ir(uint8_t *data, uint8_t bitcount)
     {
+        current_ir = ir_unknown;
         JTMS.set(1);
         clk(); // ->select-dr
         clk(); // ->select-ir
@@ -95,9 +189,13 @@ public:
      *
      * на входе TMS=0 (idle)
      * на выходе TMS=1, 2-clk
+     *
+     * Если IR уже содержит нужную инструкцию, то сканирование пропускается
      */
     static uint8_t set_ir(uint8_t ir)
     {
+        if ( ir == current_ir ) return 1;
+
         JTMS.set(1);
         clk(); // ->select-dr
         clk(); // ->select-ir
@@ -107,7 +205,9 @@ public:
         uint8_t output = t.shift_xr<4>(ir);
         t.shift_xr<5>(0xFF);
 
-        return output >> 4;
+        output = output >> 4;
+        current_ir = (output == 1) ? ir : ir_unknown;
+        return output;
     }
 
     /**
@@ -191,10 +291,42 @@ public:
      */
     static error_t xpacc_io(uint8_t ir, uint8_t reg_cmd, uint32_t *data)
     {
+        if ( swd_mode ) return swd_io(ir, reg_cmd, data);
         if ( set_ir(ir) != 1 ) return 0x10;
         return set_xpacc_dr(reg_cmd, data);
     }
 
+    /**
+     * Execute i/o instruction over SWD
+     *
+     * IR selects DP or AP, SWD ACK is translated to JTAG ACK-code:
+     * OK and FAULT both give ACK_OKFAULT (FAULT is seen in CTRL/STAT)
+     *
+     * @return 0x10 on I/O failure (no reply, parity error), on success return ACK-code
+     */
+    static error_t swd_io(uint8_t ir, uint8_t reg_cmd, uint32_t *data)
+    {
+        const uint8_t ack = SWD::transfer(ir == IR_APACC, reg_cmd, data);
+        if ( ack == SWD_ACK_OK || ack == SWD_ACK_FAULT ) return ACK_OKFAULT;
+        if ( ack == SWD_ACK_WAIT ) return ACK_WAIT;
+        return 0x10;
+    }
+
+    /**
+     * Read DP register without checking sticky flags
+     *
+     * In JTAG the result comes with the next scan (RDBUFF), in SWD
+     * DP reads are not posted
+     *
+     * @return 0x10 on I/O failure, on success return ACK-code
+     */
+    static error_t read_dp_direct(uint8_t reg, uint32_t *data)
+    {
+        const uint8_t ack = xpacc_io_read(IR_DPACC, reg, data);
+        if ( swd_mode || ack == 0x10 ) return ack;
+        return xpacc_io_read(IR_DPACC, 0xC, data); // RDBUFF
+    }
+
     /**
      * Execute read from register (DPACC or APACC)
      *
@@ -225,17 +357,22 @@ public:
      */
     static error_t xpacc(uint8_t ir, uint8_t reg_cmd, uint32_t *data)
     {
+        // SELECT written directly, not through apacc()
+        if ( ir == IR_DPACC && (reg_cmd & 0x0E) == 0x08 ) current_select = select_unknown;
+
+        if ( swd_mode ) return swd_xpacc(ir, reg_cmd, data);
+
         // send command
-        if ( xpacc_io(ir, reg_cmd, data) == 0x10 ) return 0x10;
+        if ( xpacc_io(ir, reg_cmd, data) == 0x10 ) return io_failure();
 
         // send read status, recv command reply
         const uint8_t ack = xpacc_io_read(IR_DPACC, 0x4, data);
-        if ( ack == 0x10 ) return 0x10;
+        if ( ack == 0x10 ) return io_failure();
 
         // send read rdbuff, recv status reply
         uint32_t status;
         const uint8_t status_ack = xpacc_io_read(IR_DPACC, 0xC, &status);
-        if ( status_ack == 0x10 ) return 0x10;
+        if ( status_ack == 0x10 ) return io_failure();
 
         if ( ack == ACK_OKFAULT && status_ack == ACK_OKFAULT && !is_error_status(status) )
         {
@@ -244,9 +381,119 @@ public:
 
         *data = status;
 
+        invalidate_cache();
         return ack | 0x20;
     }
 
+    /**
+     * Execute read/write transaction over SWD
+     *
+     * AP reads are posted, so the result is taken from RDBUFF, then
+     * CTRL/STAT is checked. On error sticky flags are cleared, otherwise
+     * SW-DP would reject all following AP accesses
+     *
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t swd_xpacc(uint8_t ir, uint8_t reg_cmd, uint32_t *data)
+    {
+        uint8_t ack = xpacc_io(ir, reg_cmd, data);
+        if ( ack == 0x10 ) return io_failure();
+
+        if ( ack == ACK_OKFAULT && ir == IR_APACC && (reg_cmd & 0b10) )
+        {
+            ack = xpacc_io_read(IR_DPACC, 0xC, data); // RDBUFF
+            if ( ack == 0x10 ) return io_failure();
+        }
+
+        uint32_t status;
+        const uint8_t status_ack = xpacc_io_read(IR_DPACC, 0x4, &status);
+        if ( status_ack == 0x10 ) return io_failure();
+
+        if ( ack == ACK_OKFAULT && status_ack == ACK_OKFAULT && !is_error_status(status) )
+        {
+            return 0;
+        }
+
+        *data = status;
+
+        clear_sticky(status);
+        invalidate_cache();
+        return ack | 0x20;
+    }
+
+    static error_t io_failure()
+    {
+        invalidate_cache();
+        return 0x10;
+    }
+
+    /**
+     * Execute posted transaction (DPACC or APACC), pipelined mode
+     *
+     * Only the command scan is made: CTRL/STAT is not checked, the result
+     * of a read is returned by the next scan (or by RDBUFF). Sticky flags
+     * must be checked later with check_sticky()
+     *
+     * @return 0 on success, 0x10 on I/O failure, 0x2X if ACK is not OK/FAULT
+     */
+    static error_t xpacc_posted(uint8_t ir, uint8_t reg_cmd, uint32_t *data)
+    {
+        const uint8_t ack = xpacc_io(ir, reg_cmd, data);
+        if ( ack == 0x10 ) return io_failure();
+        if ( ack != ACK_OKFAULT ) return ack | 0x20;
+        return 0;
+    }
+
+    /**
+     * Sticky flags in CTRL/STAT: STICKYERR, STICKYCMP, STICKYORUN
+     */
+    static constexpr uint32_t sticky_mask = (1 << 5) | (1 << 4) | (1 << 1);
+
+    /**
+     * Power-up requests in CTRL/STAT: CSYSPWRUPREQ, CDBGPWRUPREQ
+     */
+    static constexpr uint32_t pwrup_mask = (uint32_t(1) << 30) | (uint32_t(1) << 28);
+
+    /**
+     * Check sticky flags after a series of posted transactions
+     *
+     * If some flag is set it is cleared (write-1-to-clear on JTAG-DP),
+     * cached state is dropped and the error is returned, so the caller
+     * can retry the whole series
+     *
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t check_sticky()
+    {
+        uint32_t status = 0;
+        const uint8_t ack = read_dp_direct(0x4, &status);
+        if ( ack == 0x10 ) return io_failure();
+        if ( ack == ACK_OKFAULT && !is_error_status(status) ) return 0;
+
+        invalidate_cache();
+        clear_sticky(status);
+        return 0x20 | ack;
+    }
+
+    /**
+     * Clear sticky flags
+     *
+     * JTAG-DP: write-1-to-clear in CTRL/STAT (power-up requests are kept),
+     * SW-DP: STKCMPCLR, STKERRCLR, WDERRCLR, ORUNERRCLR in ABORT register
+     */
+    static void clear_sticky(uint32_t status)
+    {
+        if ( swd_mode )
+        {
+            uint32_t abort = 0x1E;
+            xpacc_io_write(IR_DPACC, 0x0, &abort);
+            return;
+        }
+
+        uint32_t clear = (status & pwrup_mask) | sticky_mask;
+        write_dp(0x4, &clear);
+    }
+
     /**
      * Read from register (DPACC or APACC)
      *
@@ -287,6 +534,27 @@ public:
         return write_xpacc(IR_DPACC, reg, data);
     }
 
+    /**
+     * Write SELECT register if AP or register bank differs from cached one
+     *
+     * @return 0 on success, 0x4X on select failure (status is stored to data)
+     */
+    static error_t select_ap(uint8_t ap, uint8_t reg_cmd, uint32_t *data)
+    {
+        const uint32_t select = (uint32_t(ap) << 24) | (reg_cmd & 0xF0);
+        if ( select == current_select ) return 0;
+
+        uint32_t temp = select;
+        if ( auto error = write_dp(0x8, &temp) )
+        {
+            *data = temp;
+            return error | 0x40;
+        }
+
+        current_select = select;
+        return 0;
+    }
+
     /**
      * Execute read/write transaction (APACC)
      *
@@ -297,13 +565,11 @@ public:
      */
     static error_t apacc(uint8_t ap, uint8_t reg_cmd, uint32_t *data)
     {
-        // SELECT AP
-        uint32_t temp = (uint32_t(ap) << 24) | (reg_cmd & 0xF0);
-        if ( auto error = write_dp(0x8, &temp) )
-        {
-            *data = temp;
-            return error | 0x40;
-        }
+        // SELECT AP (skipped if already selected)
+        if ( auto error = select_ap(ap, reg_cmd, data) ) return error;
+
+        // CSW written directly, not through set_csw()
+        if ( (reg_cmd & 0xFE) == 0x00 ) current_csw = 0;
 
         // EXEC AP
         return xpacc(IR_APACC, reg_cmd, data);
@@ -356,7 +622,7 @@ public:
      */
     static error_t read_mem32(uint32_t addr, uint32_t &value)
     {
-        if ( auto err = write_memap(0x00, default_csw | 2) ) return err;
+        if ( auto err = set_csw(default_csw | 2) ) return err;
         if ( auto err = write_memap(0x04, addr) ) return err;
         if ( auto err = read_memap(0x0C, value) ) return err;
         return 0;
@@ -369,7 +635,7 @@ public:
      */
     static error_t read_mem16(uint32_t addr, uint16_t &value)
     {
-        if ( auto err = write_memap(0x00, default_csw | 1) ) return err;
+        if ( auto err = set_csw(default_csw | 1) ) return err;
         if ( auto err = write_memap(0x04, addr) ) return err;
         uint32_t output;
         if ( auto err = read_memap(0x0C, output) ) return err;
@@ -384,7 +650,7 @@ public:
      */
     static error_t write_mem32(uint32_t addr, uint32_t value)
     {
-        if ( auto err = write_memap(0x00, default_csw | 2) ) return err;
+        if ( auto err = set_csw(default_csw | 2) ) return err;
         if ( auto err = write_memap(0x04, addr) ) return err;
         if ( auto err = write_memap(0x0C, value) ) return err;
         return 0;
@@ -397,13 +663,175 @@ public:
      */
     static error_t write_mem16(uint32_t addr, uint16_t value)
     {
-        if ( auto err = write_memap(0x00, default_csw | 1) ) return err;
+        if ( auto err = set_csw(default_csw | 1) ) return err;
         if ( auto err = write_memap(0x04, addr) ) return err;
         const uint32_t data = (addr & 2) ? ((uint32_t(value) << 16)) : (value);
         if ( auto err = write_memap(0x0C, data) ) return err;
         return 0;
     }
 
+    /**
+     * CSW.AddrInc = single (TAR increments after every DRW access)
+     */
+    static constexpr uint32_t csw_addr_inc = 1 << 4;
+
+    /**
+     * TAR auto-increment is guaranteed only within 1KB block
+     */
+    static constexpr uint32_t tar_wrap_mask = 0x3FF;
+
+    /**
+     * Write CSW register if it differs from cached one
+     *
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t set_csw(uint32_t csw)
+    {
+        if ( csw == current_csw ) return 0;
+        if ( auto err = write_memap(0x00, csw) ) return err;
+        current_csw = csw;
+        return 0;
+    }
+
+    /**
+     * How many times a block transfer is retried on sticky error
+     */
+    static constexpr uint8_t block_retries = 3;
+
+    /**
+     * Prepare MEM-AP for block transfer: CSW (32-bit, auto-increment) and TAR
+     *
+     * SELECT is left at MEM-AP bank 0, so DRW can be accessed directly.
+     * TAR is written in pipelined mode, it is checked by check_sticky()
+     * at the end of the block
+     *
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t block_begin(uint32_t addr)
+    {
+        uint32_t temp;
+        if ( auto err = select_ap(memap, 0x00, &temp) ) return err;
+        if ( auto err = set_csw(default_csw | csw_addr_inc | 2) ) return err;
+        return xpacc_posted(IR_APACC, request_write(0x04), &addr);
+    }
+
+    /**
+     * Max words in one chunk of block transfer (up to 1KB boundary)
+     */
+    static uint16_t block_chunk(uint32_t addr, uint16_t count)
+    {
+        const uint16_t n = (tar_wrap_mask + 1 - (addr & tar_wrap_mask)) / 4;
+        return (n < count) ? n : count;
+    }
+
+    /**
+     * Read one chunk (within 1KB) in pipelined mode
+     *
+     * DRW reads are posted: every scan returns the result of the previous
+     * one, the last word is taken from RDBUFF
+     */
+    static error_t read_chunk32(uint32_t addr, uint32_t *data, uint16_t n, bool set_tar)
+    {
+        if ( set_tar )
+        {
+            if ( auto err = block_begin(addr) ) return err;
+        }
+
+        uint32_t value = 0;
+        for(uint16_t i = 0; i < n; i++)
+        {
+            value = 0;
+            if ( auto err = xpacc_posted(IR_APACC, request_read(0x0C), &value) ) return err;
+            if ( i > 0 ) data[i - 1] = value;
+        }
+
+        value = 0;
+        if ( auto err = xpacc_posted(IR_DPACC, request_read(0x0C), &value) ) return err; // RDBUFF
+        data[n - 1] = value;
+
+        return check_sticky();
+    }
+
+    /**
+     * Write one chunk (within 1KB) in pipelined mode
+     */
+    static error_t write_chunk32(uint32_t addr, const uint32_t *data, uint16_t n)
+    {
+        if ( auto err = block_begin(addr) ) return err;
+
+        for(uint16_t i = 0; i < n; i++)
+        {
+            uint32_t value = data[i];
+            if ( auto err = xpacc_posted(IR_APACC, request_write(0x0C), &value) ) return err;
+        }
+
+        return check_sticky();
+    }
+
+    /**
+     * Read block of 32-bit words with MEM-AP auto-increment
+     *
+     * TAR is written on the first call and at every 1KB boundary, sticky
+     * flags are checked once per chunk, a failed chunk is retried
+     *
+     * @param addr - start address, on return points after the block
+     * @param first - CSW/TAR are not set yet
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t read_block32(uint32_t &addr, uint32_t *data, uint16_t count, bool first)
+    {
+        while ( count > 0 )
+        {
+            const uint16_t n = block_chunk(addr, count);
+
+            error_t err = 0;
+            bool set_tar = first || (addr & tar_wrap_mask) == 0;
+            for(uint8_t retry = 0; retry < block_retries; retry++)
+            {
+                err = read_chunk32(addr, data, n, set_tar);
+                if ( err == 0 ) break;
+                set_tar = true;
+            }
+            if ( err ) return err;
+            first = false;
+
+            data += n;
+            addr += n * 4;
+            count -= n;
+        }
+        return 0;
+    }
+
+    /**
+     * Write block of 32-bit words with MEM-AP auto-increment
+     *
+     * TAR is written at start and at every 1KB boundary, sticky flags
+     * are checked once per chunk, a failed chunk is retried
+     *
+     * @param addr - start address, on return points after the block
+     * @return 0 on success, 0x2X on command failure where X is ACK-code
+     */
+    static error_t write_block32(uint32_t &addr, const uint32_t *data, uint16_t count)
+    {
+        while ( count > 0 )
+        {
+            const uint16_t n = block_chunk(addr, count);
+
+            error_t err = 0;
+            for(uint8_t retry = 0; retry < block_retries; retry++)
+            {
+                err = write_chunk32(addr, data, n);
+                if ( err == 0 ) break;
+            }
+            if ( err ) return err;
+
+            data += n;
+            addr += n * 4;
+            count -= n;
+        }
+        return 0;
+    }
+
     /**
      * Read from FPEC register
      *
@@ -0,0 +1,203 @@
+#ifndef PIGRO_SWD_H
+#define PIGRO_SWD_H
+
+#include <avr/io.h>
+#include <avrxx/io.h>
+#include <tiny/io.h>
+
+#include "jtag.h"
+
+/**
+ * SWD использует те же линии, что и JTAG: SWCLK = TCK, SWDIO = TMS
+ */
+#define SWCLK JTCK
+#define SWDIO avr::pin(PORTA, PINA, PA3)
+#define SWDIO_DIR avr::pin(DDRA, PA3)
+
+class SWD
+{
+public:
+
+    static constexpr uint8_t SWD_ACK_OK = 0b001;
+    static constexpr uint8_t SWD_ACK_WAIT = 0b010;
+    static constexpr uint8_t SWD_ACK_FAULT = 0b100;
+
+    /**
+     * Ошибка четности в фазе данных (вместо ACK)
+     */
+    static constexpr uint8_t SWD_PARITY_ERROR = 0xFF;
+
+protected:
+
+    static void swclk()
+    {
+        SWCLK.set(true);
+        SWCLK.set(false);
+    }
+
+    static uint8_t parity(uint8_t x)
+    {
+        x ^= x >> 4;
+        x ^= x >> 2;
+        x ^= x >> 1;
+        return x & 1;
+    }
+
+    /**
+     * Выдать несколько битов на SWDIO, младшим битом вперед
+     *
+     * Цель защелкивает бит по фронту SWCLK
+     */
+    static void swd_write(uint8_t data, uint8_t bitcount = 8)
+    {
+        while ( bitcount > 0 )
+        {
+            SWDIO.set(data & 1);
+            data = data >> 1;
+            swclk();
+            bitcount--;
+        }
+    }
+
+    /**
+     * Прочитать несколько битов с SWDIO, младшим битом вперед
+     *
+     * Цель выставляет бит по фронту SWCLK, читаем до следующего фронта
+     */
+    static uint8_t swd_read(uint8_t bitcount = 8)
+    {
+        uint8_t output = 0;
+        for(uint8_t i = 0; i < bitcount; i++)
+        {
+            output = (output >> 1) | (SWDIO.value() ? 0x80 : 0);
+            swclk();
+        }
+        return output >> (8 - bitcount);
+    }
+
+    /**
+     * Такт смены направления: хост отпускает SWDIO
+     */
+    static void turn_input()
+    {
+        SWDIO_DIR.set(0);
+        SWDIO.set(1); // подтяжка
+        swclk();
+    }
+
+    /**
+     * Такт смены направления: хост снова управляет SWDIO
+     */
+    static void turn_output()
+    {
+        swclk();
+        SWDIO.set(1);
+        SWDIO_DIR.set(1);
+    }
+
+    /**
+     * Холостые такты с SWDIO=0 после транзакции
+     */
+    static void swd_idle()
+    {
+        swd_write(0x00, 8);
+    }
+
+public:
+
+    /**
+     * Line reset: не меньше 50 тактов с SWDIO=1
+     */
+    static void line_reset()
+    {
+        SWDIO_DIR.set(1);
+        for(uint8_t i = 0; i < 7; i++) swd_write(0xFF);
+    }
+
+    /**
+     * Переключить SW-DJ-DP из JTAG в SWD (последовательность 0xE79E)
+     *
+     * После переключения нужно прочитать DPIDR, иначе DP останется
+     * в состоянии line reset
+     */
+    static void switch_to_swd()
+    {
+        line_reset();
+        swd_write(0x9E);
+        swd_write(0xE7);
+        line_reset();
+        swd_idle();
+    }
+
+    /**
+     * Переключить SW-DJ-DP из SWD обратно в JTAG (последовательность 0xE73C)
+     */
+    static void switch_to_jtag()
+    {
+        line_reset();
+        swd_write(0x3C);
+        swd_write(0xE7);
+        line_reset();
+    }
+
+    /**
+     * Выполнить транзакцию SWD
+     *
+     * Фазы: запрос (8 бит), смена направления, ACK (3 бита), данные
+     * (32 бита + четность) в ту или другую сторону, холостые такты.
+     * При WAIT/FAULT фаза данных пропускается
+     *
+     * @param ap - true для AP, false для DP
+     * @param reg_cmd - регистр (bits[3:2]) и команда (bits[1]: 1 - чтение, 0 - запись)
+     * @param data - данные для записи или прочитанные данные
+     * @return ACK-код или SWD_PARITY_ERROR
+     */
+    static uint8_t transfer(bool ap, uint8_t reg_cmd, uint32_t *data)
+    {
+        const bool read = reg_cmd & 0b10;
+        const uint8_t req = (ap ? 0b0001 : 0) | (read ? 0b0010 : 0) | (reg_cmd & 0b1100);
+        const uint8_t request = 0b10000001 | (req << 1) | (parity(req) << 5);
+
+        swd_write(request);
+        turn_input();
+
+        const uint8_t ack = swd_read(3);
+        if ( ack != SWD_ACK_OK )
+        {
+            turn_output();
+            swd_idle();
+            return ack;
+        }
+
+        uint8_t *bytes = reinterpret_cast<uint8_t*>(data);
+        uint8_t p = 0;
+        if ( read )
+        {
+            for(uint8_t i = 0; i < 4; i++)
+            {
+                bytes[i] = swd_read();
+                p ^= bytes[i];
+            }
+            const uint8_t bit = swd_read(1);
+            turn_output();
+            swd_idle();
+            if ( bit != parity(p) ) return SWD_PARITY_ERROR;
+        }
+        else
+        {
+            turn_output();
+            for(uint8_t i = 0; i < 4; i++)
+            {
+                swd_write(bytes[i]);
+                p ^= bytes[i];
+            }
+            swd_write(parity(p), 1);
+            swd_idle();
+        }
+
+        return ack;
+    }
+
+};
+
+#endif // PIGRO_SWD_H
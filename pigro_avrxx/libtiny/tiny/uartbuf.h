@@ -65,6 +65,14 @@ namespace tiny
             buf.clear();
         }
 
+        /**
+         * Все данные переданы в UART (последний байт может еще передаваться)
+         */
+        bool output_empty() const
+        {
+            return buf.output().empty();
+        }
+
     };
 
 }